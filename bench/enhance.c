@@ -0,0 +1,131 @@
+#include <cairo.h>
+#include <glib.h>
+
+#include "enhance.h"
+#include "pool.h"
+#include "scale2x.h"
+
+/*
+ * Times of the enhancement presets on a 4K image, against the 16.7 ms of
+ * a 60 Hz frame. The export enhances the whole image with
+ * enhance_surface, the preview draws a screen sized view of it through
+ * enhance_draw from an empty tile cache. The image is tiled from the
+ * given one to 3840x2160.
+ *
+ * usage: swappy-enhance-bench [image.png]
+ */
+
+#define BENCH_WIDTH 3840
+#define BENCH_HEIGHT 2160
+#define BENCH_SCREEN_WIDTH 1280
+#define BENCH_SCREEN_HEIGHT 720
+#define BENCH_RUNS 20
+#define BENCH_FRAME_MS (1000.0 / 60)
+
+static gint compare_times(gconstpointer a, gconstpointer b) {
+  gint64 x = *(const gint64 *)a;
+  gint64 y = *(const gint64 *)b;
+
+  return (x > y) - (x < y);
+}
+
+// Median of the run times, in milliseconds
+static gdouble median_ms(gint64 *times, guint n) {
+  qsort(times, n, sizeof(gint64), compare_times);
+  return times[n / 2] / 1000.0;
+}
+
+static gint64 export_run(cairo_surface_t *source, EnhancePreset preset) {
+  gint64 start = g_get_monotonic_time();
+  cairo_surface_t *enhanced = enhance_surface(source, preset);
+  gint64 elapsed = g_get_monotonic_time() - start;
+
+  if (enhanced) {
+    cairo_surface_destroy(enhanced);
+  }
+
+  return elapsed;
+}
+
+// The whole image fit to the screen, as the unzoomed preview
+static gint64 preview_run(cairo_surface_t *screen, cairo_surface_t *source,
+                          const struct enhance_lut *lut) {
+  struct enhance_cache *cache = NULL;
+  struct swappy_box area = {0, 0, BENCH_WIDTH, BENCH_HEIGHT};
+  cairo_t *cr = cairo_create(screen);
+  gint64 start = g_get_monotonic_time();
+
+  enhance_draw(&cache, cr, source, 0, &area, lut,
+               (gdouble)BENCH_SCREEN_WIDTH / BENCH_WIDTH);
+  cairo_surface_flush(screen);
+
+  gint64 elapsed = g_get_monotonic_time() - start;
+  cairo_destroy(cr);
+  enhance_cache_free(cache);
+
+  return elapsed;
+}
+
+static void bench(cairo_surface_t *screen, cairo_surface_t *source,
+                  EnhancePreset preset) {
+  gint64 exported[BENCH_RUNS], previewed[BENCH_RUNS];
+  struct enhance_lut lut;
+
+  enhance_lut_init(&lut, preset, NULL);
+  export_run(source, preset);
+
+  for (guint i = 0; i < BENCH_RUNS; i++) {
+    exported[i] = export_run(source, preset);
+    previewed[i] = preview_run(screen, source, &lut);
+  }
+
+  gdouble export_ms = median_ms(exported, BENCH_RUNS);
+
+  g_print("%-8s export %8.2f ms (%s a frame)  preview %8.2f ms\n",
+          enhance_preset_name(preset), export_ms,
+          export_ms < BENCH_FRAME_MS ? "within" : "over",
+          median_ms(previewed, BENCH_RUNS));
+}
+
+int main(int argc, char *argv[]) {
+  const gchar *file = argc > 1 ? argv[1] : "test/images/large.png";
+  cairo_surface_t *image = cairo_image_surface_create_from_png(file);
+
+  if (cairo_surface_status(image) != CAIRO_STATUS_SUCCESS) {
+    g_printerr("could not load %s: %s\n", file,
+               cairo_status_to_string(cairo_surface_status(image)));
+    cairo_surface_destroy(image);
+    return EXIT_FAILURE;
+  }
+
+  cairo_surface_t *source = cairo_image_surface_create(
+      CAIRO_FORMAT_ARGB32, BENCH_WIDTH, BENCH_HEIGHT);
+  cairo_t *cr = cairo_create(source);
+  cairo_set_source_surface(cr, image, 0, 0);
+  cairo_pattern_set_extend(cairo_get_source(cr), CAIRO_EXTEND_REPEAT);
+  cairo_paint(cr);
+  cairo_destroy(cr);
+  cairo_surface_destroy(image);
+
+  cairo_surface_t *screen = cairo_image_surface_create(
+      CAIRO_FORMAT_ARGB32, BENCH_SCREEN_WIDTH, BENCH_SCREEN_HEIGHT);
+
+  pool_init(0);
+  scale_set_parallel(pool_parallel_for, pool_get_n_threads());
+
+  g_print("%s tiled to %dx%d, %s kernels, %u threads\n", file, BENCH_WIDTH,
+          BENCH_HEIGHT, scale_simd_name(scale_simd_get()),
+          pool_get_n_threads());
+
+  // Auto needs a histogram per image, the export counts it every time
+  for (EnhancePreset preset = ENHANCE_SUBTLE; preset < ENHANCE_N_PRESETS;
+       preset++) {
+    bench(screen, source, preset);
+  }
+
+  pool_finish();
+  cairo_surface_destroy(screen);
+  cairo_surface_destroy(source);
+
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,398 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <cairo.h>
+#include <glib.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "pool.h"
+#include "scale2x.h"
+
+/*
+ * Times of the upscaling kernels, to track regressions between releases.
+ * Every kernel runs on synthetic patterns and on the given images, the
+ * viewport one at several viewport sizes. Each case is run once to warm
+ * up, then timed over repeated runs with the monotonic clock. Results are
+ * printed as CSV, or JSON with --json.
+ *
+ * usage: swappy-scale-bench [--json] [--runs N] [--threads N] [image.png...]
+ */
+
+// Whole image kernels read at most this much of the inputs
+#define BENCH_MAX_WIDTH 1920
+#define BENCH_MAX_HEIGHT 1080
+#define BENCH_AA_THRESHOLD 16
+
+struct bench_input {
+  gchar *name;
+  cairo_surface_t *surface; /* ARGB32 */
+  guint32 *pixels;          /* Top left of the surface, packed */
+  gint width;
+  gint height;
+};
+
+struct bench_result {
+  const gchar *kernel;
+  const gchar *input;
+  gint width; /* Source pixels read */
+  gint height;
+  gint scale;
+  gint runs;
+  gdouble min_ms;
+  gdouble median_ms;
+  gdouble mean_ms;
+  gdouble max_ms;
+  gdouble mpixels_per_s; /* Output pixels, at the median time */
+};
+
+struct bench_case {
+  const gchar *kernel;
+  struct bench_input *input;
+  gint x; /* Viewport, in source pixels */
+  gint y;
+  gint width;
+  gint height;
+  gint scale;
+  guint32 *dst;
+};
+
+typedef void (*bench_func)(struct bench_case *c);
+
+static gboolean json = FALSE;
+static gint runs = 10;
+static gint threads = 0;
+static gchar **files = NULL;
+
+static gdouble now_ms(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static gint compare_doubles(gconstpointer a, gconstpointer b) {
+  gdouble x = *(const gdouble *)a;
+  gdouble y = *(const gdouble *)b;
+
+  return (x > y) - (x < y);
+}
+
+static void run_scale2x(struct bench_case *c) {
+  scale2x(c->input->pixels, c->dst, c->width, c->height);
+}
+
+static void run_scale3x(struct bench_case *c) {
+  scale3x(c->input->pixels, c->dst, c->width, c->height);
+}
+
+static void run_scale2x_aa(struct bench_case *c) {
+  scale2x_aa(c->input->pixels, c->dst, c->width, c->height,
+             BENCH_AA_THRESHOLD);
+}
+
+static void run_scale_nx(struct bench_case *c) {
+  gint width, height;
+
+  free(scale_nx(c->input->pixels, c->width, c->height, c->scale, &width,
+                &height));
+}
+
+static void run_scale2x_viewport(struct bench_case *c) {
+  cairo_surface_t *surface =
+      scale2x_viewport(c->input->surface, c->x, c->y, c->width, c->height,
+                       c->scale);
+
+  if (surface) {
+    cairo_surface_destroy(surface);
+  }
+}
+
+static struct bench_result bench_run(struct bench_case *c, bench_func func) {
+  gdouble *times = g_new(gdouble, runs);
+  gdouble total = 0;
+
+  func(c);
+  for (gint i = 0; i < runs; i++) {
+    gdouble start = now_ms();
+
+    func(c);
+    times[i] = now_ms() - start;
+    total += times[i];
+  }
+  qsort(times, runs, sizeof(gdouble), compare_doubles);
+
+  struct bench_result result = {
+      .kernel = c->kernel,
+      .input = c->input->name,
+      .width = c->width,
+      .height = c->height,
+      .scale = c->scale,
+      .runs = runs,
+      .min_ms = times[0],
+      .median_ms = times[runs / 2],
+      .mean_ms = total / runs,
+      .max_ms = times[runs - 1],
+  };
+  if (result.median_ms > 0) {
+    result.mpixels_per_s = (gdouble)c->width * c->scale * c->height *
+                           c->scale / (result.median_ms * 1000.0);
+  }
+
+  g_free(times);
+  return result;
+}
+
+static void print_result(struct bench_result *result, gboolean first) {
+  if (json) {
+    g_print("%s\n    {\"kernel\": \"%s\", \"input\": \"%s\", \"width\": %d, "
+            "\"height\": %d, \"scale\": %d, \"runs\": %d, \"min_ms\": %.4f, "
+            "\"median_ms\": %.4f, \"mean_ms\": %.4f, \"max_ms\": %.4f, "
+            "\"mpixels_per_s\": %.2f}",
+            first ? "" : ",", result->kernel, result->input, result->width,
+            result->height, result->scale, result->runs, result->min_ms,
+            result->median_ms, result->mean_ms, result->max_ms,
+            result->mpixels_per_s);
+  } else {
+    g_print("%s,%s,%d,%d,%d,%d,%.4f,%.4f,%.4f,%.4f,%.2f,%s,%u\n",
+            result->kernel, result->input, result->width, result->height,
+            result->scale, result->runs, result->min_ms, result->median_ms,
+            result->mean_ms, result->max_ms, result->mpixels_per_s,
+            scale_simd_name(scale_simd_get()), pool_get_n_threads());
+  }
+}
+
+static void input_init(struct bench_input *input, const gchar *name,
+                       cairo_surface_t *surface) {
+  gint stride = cairo_image_surface_get_stride(surface);
+  guchar *data = cairo_image_surface_get_data(surface);
+
+  input->name = g_strdup(name);
+  input->surface = surface;
+  input->width = MIN(cairo_image_surface_get_width(surface), BENCH_MAX_WIDTH);
+  input->height =
+      MIN(cairo_image_surface_get_height(surface), BENCH_MAX_HEIGHT);
+  input->pixels = g_new(guint32, (gsize)input->width * input->height);
+
+  cairo_surface_flush(surface);
+  for (gint y = 0; y < input->height; y++) {
+    memcpy(input->pixels + (gsize)y * input->width,
+           data + (gsize)y * stride, (gsize)input->width * sizeof(guint32));
+  }
+}
+
+static void input_finish(struct bench_input *input) {
+  g_free(input->name);
+  g_free(input->pixels);
+  cairo_surface_destroy(input->surface);
+}
+
+// Screenshot-like extremes: flat areas, thin lines, all edges and noise
+static cairo_surface_t *pattern_new(const gchar *name) {
+  cairo_surface_t *surface = cairo_image_surface_create(
+      CAIRO_FORMAT_ARGB32, BENCH_MAX_WIDTH, BENCH_MAX_HEIGHT);
+  gint stride = cairo_image_surface_get_stride(surface);
+  guchar *data = cairo_image_surface_get_data(surface);
+  guint32 seed = 0x9e3779b9;
+
+  for (gint y = 0; y < BENCH_MAX_HEIGHT; y++) {
+    guint32 *row = (guint32 *)(data + (gsize)y * stride);
+
+    for (gint x = 0; x < BENCH_MAX_WIDTH; x++) {
+      if (g_str_equal(name, "flat")) {
+        row[x] = 0xffffffff;
+      } else if (g_str_equal(name, "diagonal")) {
+        row[x] = ABS(x - y) < 3 ? 0xff00ff00 : 0xffffffff;
+      } else if (g_str_equal(name, "checker")) {
+        row[x] = (x + y) % 2 ? 0xff000000 : 0xffffffff;
+      } else {
+        seed ^= seed << 13;
+        seed ^= seed >> 17;
+        seed ^= seed << 5;
+        row[x] = seed | 0xff000000;
+      }
+    }
+  }
+
+  cairo_surface_mark_dirty(surface);
+  return surface;
+}
+
+static cairo_surface_t *image_new(const gchar *file) {
+  cairo_surface_t *image = cairo_image_surface_create_from_png(file);
+
+  if (cairo_surface_status(image) != CAIRO_STATUS_SUCCESS) {
+    g_printerr("could not load %s: %s\n", file,
+               cairo_status_to_string(cairo_surface_status(image)));
+    cairo_surface_destroy(image);
+    return NULL;
+  }
+
+  // The kernels work on ARGB32
+  cairo_surface_t *surface = cairo_image_surface_create(
+      CAIRO_FORMAT_ARGB32, cairo_image_surface_get_width(image),
+      cairo_image_surface_get_height(image));
+  cairo_t *cr = cairo_create(surface);
+  cairo_set_source_surface(cr, image, 0, 0);
+  cairo_paint(cr);
+  cairo_destroy(cr);
+  cairo_surface_destroy(image);
+
+  return surface;
+}
+
+static void bench_input(struct bench_input *input, gboolean *first) {
+  static const struct {
+    const gchar *kernel;
+    bench_func func;
+    gint scale;
+    gboolean has_dst; /* Writes to a buffer given by the caller */
+  } kernels[] = {
+      {"scale2x", run_scale2x, 2, TRUE},
+      {"scale3x", run_scale3x, 3, TRUE},
+      {"scale2x_aa", run_scale2x_aa, 2, TRUE},
+      {"scale_nx", run_scale_nx, 4, FALSE},
+  };
+  // Source pixels shown on a 1920x1080 screen at 2x, 3x and 4x
+  static const gint viewports[][2] = {{960, 540}, {640, 360}, {480, 270}};
+  static const gint viewport_scales[] = {2, 4};
+
+  for (gsize i = 0; i < G_N_ELEMENTS(kernels); i++) {
+    struct bench_case c = {
+        .kernel = kernels[i].kernel,
+        .input = input,
+        .width = input->width,
+        .height = input->height,
+        .scale = kernels[i].scale,
+    };
+    if (kernels[i].has_dst) {
+      c.dst = g_try_new(guint32,
+                        (gsize)c.width * c.scale * c.height * c.scale);
+    }
+    if (kernels[i].has_dst && !c.dst) {
+      g_printerr("out of memory for %s on %s\n", c.kernel, input->name);
+      continue;
+    }
+
+    struct bench_result result = bench_run(&c, kernels[i].func);
+    print_result(&result, *first);
+    *first = FALSE;
+    g_free(c.dst);
+  }
+
+  gint width = cairo_image_surface_get_width(input->surface);
+  gint height = cairo_image_surface_get_height(input->surface);
+
+  for (gsize i = 0; i < G_N_ELEMENTS(viewports); i++) {
+    for (gsize j = 0; j < G_N_ELEMENTS(viewport_scales); j++) {
+      // Centered in the image, clamped like scale2x_viewport does
+      struct bench_case c = {
+          .kernel = "scale2x_viewport",
+          .input = input,
+          .width = MIN(viewports[i][0], width),
+          .height = MIN(viewports[i][1], height),
+          .scale = viewport_scales[j],
+      };
+      c.x = (width - c.width) / 2;
+      c.y = (height - c.height) / 2;
+
+      struct bench_result result = bench_run(&c, run_scale2x_viewport);
+      print_result(&result, *first);
+      *first = FALSE;
+    }
+  }
+}
+
+int main(int argc, char *argv[]) {
+  const GOptionEntry options[] = {
+      {
+          .long_name = "json",
+          .short_name = 'j',
+          .arg = G_OPTION_ARG_NONE,
+          .arg_data = &json,
+          .description = "Print JSON instead of CSV",
+      },
+      {
+          .long_name = "runs",
+          .short_name = 'r',
+          .arg = G_OPTION_ARG_INT,
+          .arg_data = &runs,
+          .description = "Timed runs of each case, 10 by default",
+          .arg_description = "N",
+      },
+      {
+          .long_name = "threads",
+          .short_name = 't',
+          .arg = G_OPTION_ARG_INT,
+          .arg_data = &threads,
+          .description = "Worker threads, 0 for one per core",
+          .arg_description = "N",
+      },
+      {
+          .long_name = G_OPTION_REMAINING,
+          .arg = G_OPTION_ARG_FILENAME_ARRAY,
+          .arg_data = &files,
+      },
+      {NULL}};  // NOLINT(clang-diagnostic-missing-field-initializers)
+  static const gchar *patterns[] = {"flat", "diagonal", "checker", "noise"};
+  GOptionContext *context = g_option_context_new("[image.png...]");
+  GError *error = NULL;
+
+  g_option_context_add_main_entries(context, options, NULL);
+  if (!g_option_context_parse(context, &argc, &argv, &error)) {
+    g_printerr("%s\n", error->message);
+    g_error_free(error);
+    g_option_context_free(context);
+    return EXIT_FAILURE;
+  }
+  g_option_context_free(context);
+  runs = MAX(runs, 1);
+
+  pool_init(threads);
+  scale_set_parallel(pool_parallel_for, pool_get_n_threads());
+
+  if (json) {
+    g_print("{\n  \"simd\": \"%s\",\n  \"threads\": %u,\n  \"results\": [",
+            scale_simd_name(scale_simd_get()), pool_get_n_threads());
+  } else {
+    g_print("kernel,input,width,height,scale,runs,min_ms,median_ms,mean_ms,"
+            "max_ms,mpixels_per_s,simd,threads\n");
+  }
+
+  gboolean first = TRUE;
+  gint status = EXIT_SUCCESS;
+
+  for (gsize i = 0; i < G_N_ELEMENTS(patterns); i++) {
+    struct bench_input input;
+
+    input_init(&input, patterns[i], pattern_new(patterns[i]));
+    bench_input(&input, &first);
+    input_finish(&input);
+  }
+
+  for (gchar **file = files; file && *file; file++) {
+    cairo_surface_t *surface = image_new(*file);
+    struct bench_input input;
+
+    if (!surface) {
+      status = EXIT_FAILURE;
+      continue;
+    }
+
+    gchar *name = g_path_get_basename(*file);
+    input_init(&input, name, surface);
+    g_free(name);
+    bench_input(&input, &first);
+    input_finish(&input);
+  }
+
+  if (json) {
+    g_print("\n  ]\n}\n");
+  }
+
+  scale_surface_pool_clear();
+  pool_finish();
+  g_strfreev(files);
+
+  return status;
+}
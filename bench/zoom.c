@@ -0,0 +1,137 @@
+#include <cairo.h>
+#include <glib.h>
+
+#include "pool.h"
+#include "scale2x.h"
+#include "zoom.h"
+
+/*
+ * Frame times of the zoomed view for each zoom engine, to pick between
+ * quality and latency. A frame fills a screen sized view through
+ * zoom_draw, from an empty tile cache, then while panning by one tile per
+ * frame so that only the exposed tiles are upscaled. Zoom levels between
+ * the factors of an engine include resampling to the screen.
+ *
+ * usage: swappy-zoom-bench [image.png]
+ */
+
+#define BENCH_SCREEN_WIDTH 1280
+#define BENCH_SCREEN_HEIGHT 720
+#define BENCH_FRAMES 20
+
+static const gchar *engines[] = {"epx", "xbr"};
+static const gdouble zooms[] = {2, 2.5, 3, 4};
+
+static gint compare_times(gconstpointer a, gconstpointer b) {
+  gint64 x = *(const gint64 *)a;
+  gint64 y = *(const gint64 *)b;
+
+  return (x > y) - (x < y);
+}
+
+static gint64 draw_frame(struct zoom_cache **cache, cairo_surface_t *screen,
+                         cairo_surface_t *source,
+                         const struct scale_engine *engine, gdouble zoom,
+                         gint x, gint y) {
+  gint factor = zoom_factor_for_scale(engine, zoom);
+  struct swappy_box area = {
+      .x = x,
+      .y = y,
+      .width = (gint)(BENCH_SCREEN_WIDTH / zoom),
+      .height = (gint)(BENCH_SCREEN_HEIGHT / zoom),
+  };
+  cairo_t *cr = cairo_create(screen);
+  gint64 start = g_get_monotonic_time();
+
+  cairo_translate(cr, -x * zoom, -y * zoom);
+  zoom_draw(cache, cr, source, 0, &area, engine, factor, zoom / factor, 0,
+            NULL);
+  cairo_surface_flush(screen);
+
+  gint64 elapsed = g_get_monotonic_time() - start;
+  cairo_destroy(cr);
+
+  return elapsed;
+}
+
+// Median of the frame times, in milliseconds
+static gdouble median_ms(gint64 *times, guint n) {
+  qsort(times, n, sizeof(gint64), compare_times);
+  return times[n / 2] / 1000.0;
+}
+
+static void bench(cairo_surface_t *source, const struct scale_engine *engine,
+                  gdouble zoom) {
+  cairo_surface_t *screen = cairo_image_surface_create(
+      CAIRO_FORMAT_ARGB32, BENCH_SCREEN_WIDTH, BENCH_SCREEN_HEIGHT);
+  gint width = cairo_image_surface_get_width(source);
+  gint height = cairo_image_surface_get_height(source);
+  gint max_x = MAX(width - (gint)(BENCH_SCREEN_WIDTH / zoom), 0);
+  gint y = MAX(height - (gint)(BENCH_SCREEN_HEIGHT / zoom), 0) / 2;
+  gint64 cold[BENCH_FRAMES], pan[BENCH_FRAMES];
+
+  for (guint i = 0; i < BENCH_FRAMES; i++) {
+    struct zoom_cache *cache = NULL;
+
+    cold[i] = draw_frame(&cache, screen, source, engine, zoom, 0, y);
+    zoom_cache_free(cache);
+  }
+
+  struct zoom_cache *cache = NULL;
+  draw_frame(&cache, screen, source, engine, zoom, 0, y);
+  for (guint i = 0; i < BENCH_FRAMES; i++) {
+    gint x = MIN((gint)(i + 1) * ZOOM_TILE_SIZE, max_x);
+
+    pan[i] = draw_frame(&cache, screen, source, engine, zoom, x, y);
+  }
+  zoom_cache_free(cache);
+
+  g_print("%-4s %3.1fx (%dx)  first frame %8.2f ms  pan %8.2f ms\n",
+          engine->name, zoom, zoom_factor_for_scale(engine, zoom),
+          median_ms(cold, BENCH_FRAMES), median_ms(pan, BENCH_FRAMES));
+
+  cairo_surface_destroy(screen);
+}
+
+int main(int argc, char *argv[]) {
+  const gchar *file = argc > 1 ? argv[1] : "test/images/large.png";
+  cairo_surface_t *image = cairo_image_surface_create_from_png(file);
+
+  if (cairo_surface_status(image) != CAIRO_STATUS_SUCCESS) {
+    g_printerr("could not load %s: %s\n", file,
+               cairo_status_to_string(cairo_surface_status(image)));
+    cairo_surface_destroy(image);
+    return EXIT_FAILURE;
+  }
+
+  // The zoomed view draws from ARGB32 surfaces
+  cairo_surface_t *source = cairo_image_surface_create(
+      CAIRO_FORMAT_ARGB32, cairo_image_surface_get_width(image),
+      cairo_image_surface_get_height(image));
+  cairo_t *cr = cairo_create(source);
+  cairo_set_source_surface(cr, image, 0, 0);
+  cairo_paint(cr);
+  cairo_destroy(cr);
+  cairo_surface_destroy(image);
+
+  pool_init(0);
+  scale_set_parallel(pool_parallel_for, pool_get_n_threads());
+
+  g_print("%s, %dx%d, %s kernels, %u threads\n", file,
+          cairo_image_surface_get_width(source),
+          cairo_image_surface_get_height(source),
+          scale_simd_name(scale_simd_get()), pool_get_n_threads());
+
+  for (gsize i = 0; i < G_N_ELEMENTS(engines); i++) {
+    const struct scale_engine *engine = scale_engine_find(engines[i]);
+
+    for (gsize j = 0; j < G_N_ELEMENTS(zooms); j++) {
+      bench(source, engine, zooms[j]);
+    }
+  }
+
+  pool_finish();
+  cairo_surface_destroy(source);
+
+  return EXIT_SUCCESS;
+}
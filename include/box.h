@@ -5,3 +5,7 @@
 bool box_parse(struct swappy_box *box, const char *str);
 bool is_empty_box(struct swappy_box *box);
 bool intersect_box(struct swappy_box *a, struct swappy_box *b);
+void union_box(struct swappy_box *box, struct swappy_box *other);
+bool clip_box(struct swappy_box *box, struct swappy_box *bounds);
+void box_from_extents(struct swappy_box *box, double x1, double y1, double x2,
+                      double y2, double padding);
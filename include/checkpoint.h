@@ -0,0 +1,11 @@
+#pragma once
+
+#include "swappy.h"
+
+#define CHECKPOINT_PAINT_INTERVAL 16
+#define CHECKPOINT_COST_INTERVAL_US 30000
+#define CHECKPOINT_MEMORY_BUDGET (256 * 1024 * 1024)
+
+struct swappy_checkpoint *checkpoint_find(struct swappy_state *state);
+void checkpoint_update(struct swappy_state *state, gint64 replay_cost);
+void checkpoint_free_all(struct swappy_state *state);
@@ -1,3 +1,4 @@
+#include "enhance.h"
 #include "swappy.h"
 
 #define CONFIG_LINE_SIZE_DEFAULT 5
@@ -12,6 +13,12 @@
 #define CONFIG_AUTO_SAVE_DEFAULT false
 #define CONFIG_CUSTOM_COLOR_DEFAULT "rgba(193,125,17,1)"
 #define CONFIG_TRANSPARENT_DEFAULT false
+#define CONFIG_WORKER_THREADS_DEFAULT 0
+#define CONFIG_ZOOM_AA_THRESHOLD_DEFAULT 0
+#define CONFIG_ZOOM_ENGINE_DEFAULT "epx"
+#define CONFIG_ENHANCE_PRESET_DEFAULT ENHANCE_NONE
+#define CONFIG_ENHANCE_SHARPEN_RADIUS_DEFAULT 1
+#define CONFIG_ENHANCE_SHARPEN_AMOUNT_DEFAULT 100
 
 void config_load(struct swappy_state *state);
 void config_free(struct swappy_state *state);
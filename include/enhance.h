@@ -0,0 +1,111 @@
+#pragma once
+
+#include <cairo.h>
+#include <glib.h>
+
+#include "swappy.h"
+
+#define ENHANCE_TILE_SIZE 128 /* Device pixels per side */
+#define ENHANCE_CACHE_BUDGET (64 * 1024 * 1024) /* Bytes of enhanced tiles */
+
+/* Values of the enhance_preset config key */
+typedef enum {
+  ENHANCE_NONE = 0,
+  ENHANCE_SUBTLE,
+  ENHANCE_STANDARD,
+  ENHANCE_VIVID,
+  ENHANCE_TEXT,
+  ENHANCE_AUTO,
+  ENHANCE_N_PRESETS,
+} EnhancePreset;
+
+/* A preset compiled for enhance_area */
+struct enhance_lut {
+  guint32 tone[3][256]; /* Blue, green and red, in their place in a pixel */
+  gint saturation;      /* 8.8 fixed point */
+  gint sharpen_radius;  /* Unsharp mask, 0 for none */
+  gint sharpen_amount;  /* 8.8 fixed point */
+  guint16 sharpen_weights[2 * SWAPPY_ENHANCE_SHARPEN_RADIUS_MAX + 1];
+};
+
+/* Unpremultiplied channel values of an image, for ENHANCE_AUTO */
+struct enhance_histogram {
+  cairo_surface_t *source;
+  guint generation;
+  guint64 counts[3][256]; /* Blue, green and red */
+  guint64 total;
+};
+
+struct enhance_tile {
+  gboolean is_valid;
+  struct swappy_box damage; /* Device pixels to enhance again */
+  cairo_surface_t *surface; /* Made once the tile is in view */
+  GList link;               /* In the LRU queue, with a surface */
+};
+
+/*
+ * The preview enhanced at display resolution, tile by tile. Tile surfaces
+ * are made for the visible area only, the least recently drawn ones are
+ * dropped past ENHANCE_CACHE_BUDGET, so memory follows the view rather
+ * than the image. Tiles are made again when the source, the compiled
+ * preset or the scale changes. Content changes reported by
+ * enhance_cache_damage only redo the damaged pixels, any other new
+ * generation redoes every tile.
+ */
+struct enhance_cache {
+  cairo_surface_t *source;
+  guint generation;
+  struct enhance_lut lut;
+  gdouble scale; /* Device pixels per source pixel */
+  gint width;    /* Whole image at scale */
+  gint height;
+  gint columns;
+  gint rows;
+  struct enhance_tile *tiles;
+  GQueue lru;    /* Tiles with a surface, most recently drawn first */
+  gsize size;    /* Bytes of tile surfaces */
+  guint hits;
+  guint misses;
+};
+
+/* Unsharp mask of ENHANCE_TEXT for the presets compiled from now on, the
+ * radius in pixels and the amount in percent */
+void enhance_set_sharpen(guint radius, guint amount);
+/* The histogram is only read by ENHANCE_AUTO, and may be NULL otherwise */
+void enhance_lut_init(struct enhance_lut *lut, EnhancePreset preset,
+                      const struct enhance_histogram *histogram);
+/*
+ * Histogram of `source` at `generation`, kept in *histogram and only made
+ * again when either changes. Returns NULL for unsupported formats.
+ */
+const struct enhance_histogram *
+enhance_histogram_get(struct enhance_histogram **histogram,
+                      cairo_surface_t *source, guint generation);
+void enhance_histogram_free(struct enhance_histogram *histogram);
+/*
+ * Enhance the `width` x `height` area at (x, y) of premultiplied ARGB32
+ * pixels into dst, strides are in pixels. Sharpening reads up to the
+ * radius around the area, edge pixels are repeated past the image, so
+ * areas enhanced apart match the whole image enhanced at once. Opaque
+ * pixels are taken as such whatever their alpha byte. Returns FALSE when
+ * out of memory.
+ */
+gboolean enhance_area(const struct enhance_lut *lut, const guint32 *src,
+                      gint src_width, gint src_height, gint src_stride, gint x,
+                      gint y, gint width, gint height, guint32 *dst,
+                      gint dst_stride, gboolean opaque);
+
+/*
+ * Enhanced copy of an ARGB32 or RGB24 image surface, the result must be
+ * destroyed. Returns NULL for other formats.
+ */
+cairo_surface_t *enhance_surface(cairo_surface_t *src, EnhancePreset preset);
+void enhance_draw(struct enhance_cache **cache, cairo_t *cr,
+                  cairo_surface_t *source, guint generation,
+                  struct swappy_box *area, const struct enhance_lut *lut,
+                  gdouble scale);
+/* `area` of the source, in source pixels, changed and is now `generation` */
+void enhance_cache_damage(struct enhance_cache *cache, struct swappy_box *area,
+                          guint generation);
+void enhance_cache_free(struct enhance_cache *cache);
+const char *enhance_preset_name(EnhancePreset preset);
@@ -4,6 +4,9 @@
 
 #include "swappy.h"
 
+#define BRUSH_INITIAL_POINTS 64
+#define BRUSH_SIMPLIFY_TOLERANCE 0.25
+
 void paint_add_temporary(struct swappy_state *state, double x, double y,
                          enum swappy_paint_type type);
 void paint_update_temporary_shape(struct swappy_state *state, double x,
@@ -14,6 +17,8 @@ void paint_update_temporary_str(struct swappy_state *state, char *event);
 void paint_update_temporary_text_clip(struct swappy_state *state, gdouble x,
                                       gdouble y);
 void paint_commit_temporary(struct swappy_state *state);
+void paint_get_bounds(struct swappy_state *state, struct swappy_paint *paint,
+                      struct swappy_box *box);
 
 void paint_free(gpointer data);
 void paint_free_all(struct swappy_state *state);
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cairo.h>
+#include <glib.h>
+
+#define PIXELATE_BLOCK_SIZE 12
+
+/*
+ * Block averages of a source surface, on a grid anchored at a fixed point.
+ * Only blocks fully inside the pixelated region are kept, blocks cut by the
+ * region edges depend on the region and are always recomputed. The grid
+ * only spans the regions pixelated since the cache was created.
+ */
+struct pixelate_cache {
+  cairo_surface_t *source;
+  guint generation;
+  gint anchor_x;
+  gint anchor_y;
+  gint block;
+  gint column0; /* Grid index of the first cached column */
+  gint row0;
+  gint columns;
+  gint rows;
+  guint32 *colors;
+  guint8 *is_valid;
+  guchar *buffer; /* Backing store of the returned surfaces, reused */
+  gsize buffer_size;
+  guint hits;
+  guint misses;
+};
+
+cairo_surface_t *pixelate_region(cairo_surface_t *surface, double x, double y,
+                                 double width, double height, double anchor_x,
+                                 double anchor_y);
+cairo_surface_t *pixelate_region_cached(struct pixelate_cache **cache,
+                                        cairo_surface_t *surface,
+                                        guint generation, double x, double y,
+                                        double width, double height,
+                                        double anchor_x, double anchor_y);
+void pixelate_cache_free(struct pixelate_cache *cache);
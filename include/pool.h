@@ -0,0 +1,10 @@
+#pragma once
+
+#include <glib.h>
+
+typedef void (*pool_job_func)(guint index, gpointer data);
+
+void pool_init(gint n_threads);
+void pool_finish(void);
+guint pool_get_n_threads(void);
+void pool_parallel_for(guint n_jobs, pool_job_func func, gpointer data);
@@ -0,0 +1,18 @@
+#pragma once
+
+#include "swappy.h"
+
+#define RASTER_TILE_SIZE 256
+
+/*
+ * Draw `paints` (oldest first) with `cr`, which is already clipped to the
+ * area being rasterized and uses image coordinates.
+ */
+typedef void (*raster_paints_func)(cairo_t *cr, GList *paints,
+                                   struct swappy_state *state);
+
+void raster_init(struct swappy_state *state, gint width, gint height);
+void raster_free(struct swappy_state *state);
+void raster_invalidate(struct swappy_state *state, struct swappy_box *area);
+bool raster_render_dirty(struct swappy_state *state, raster_paints_func func,
+                         struct swappy_box *area);
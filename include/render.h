@@ -2,4 +2,10 @@
 
 #include "swappy.h"
 
+#define RENDER_HIGHLIGHTER_ALPHA 0.4
+
 void render_state(struct swappy_state *state);
+void render_state_schedule(struct swappy_state *state);
+void render_invalidate_committed(struct swappy_state *state);
+void render_invalidate_paint(struct swappy_state *state,
+                             struct swappy_paint *paint);
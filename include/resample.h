@@ -0,0 +1,17 @@
+#pragma once
+
+#include <stdint.h>
+
+/* Area-average src onto dst. Output pixel (i, j) is the average of the
+ * source area [x + i / scale, x + (i + 1) / scale) by
+ * [y + j / scale, y + (j + 1) / scale), in source pixels, areas past the
+ * edges are clamped. Strides are in pixels. Returns 0 on failure. */
+int resample_area(const uint32_t *src, int w, int h, int src_stride,
+                  double x, double y, double scale, uint32_t *dst,
+                  int dst_w, int dst_h, int dst_stride);
+
+/* out[x] is the sum of weights[k] * src[x + k * step] for k in [0, n), in
+ * each channel. Weights are 8.8 fixed point and must add up to 256, step
+ * is in pixels: 1 blends along a row, the stride down a column. */
+void resample_blend(const uint32_t *src, int step, const uint16_t *weights,
+                    int n, uint32_t *out, int width);
@@ -3,15 +3,74 @@
 #include <stdint.h>
 #include <cairo.h>
 
+/* SIMD variants of the kernels, all produce the same output, as checked by
+ * test/simd.c */
+typedef enum {
+    SCALE_SIMD_SCALAR = 0,
+    SCALE_SIMD_SSE2,
+    SCALE_SIMD_AVX2,
+} scale_simd_level;
+
+/* Best variant for this CPU, detected on first use */
+scale_simd_level scale_simd_get(void);
+void scale_simd_set(scale_simd_level level);
+const char *scale_simd_name(scale_simd_level level);
+
+/* Split the kernels into row bands run by parallel_for, which must call
+ * func for every index in [0, n_jobs) and return once all calls are done.
+ * NULL, or a single thread, runs them on the calling thread. */
+typedef void (*scale_job_func)(unsigned int index, void *data);
+typedef void (*scale_parallel_func)(unsigned int n_jobs, scale_job_func func,
+                                    void *data);
+void scale_set_parallel(scale_parallel_func parallel_for,
+                        unsigned int n_threads);
+
 /* Scale2x (EPX) - 2x pixel art upscaling */
 void scale2x(const uint32_t *src, uint32_t *dst, int w, int h);
 
 /* Scale3x - 3x upscaling */
 void scale3x(const uint32_t *src, uint32_t *dst, int w, int h);
 
-/* Multi-pass scaling to any power-of-2 */
+/* Scale2x treating colors closer than threshold as equal */
+void scale2x_aa(const uint32_t *src, uint32_t *dst, int w, int h, int threshold);
+
+/* Fused 2x and 3x passes, writes rows [row0, row1) of the final image.
+ * Rows must be multiples of the last factor, strides are in pixels. With
+ * a threshold above 0 the 2x passes are scale2x_aa ones.
+ * Returns 0 on failure. */
+int scale_passes(const uint32_t *src, int w, int h, int src_stride,
+                 const int *factors, int n_passes, int threshold,
+                 uint32_t *dst, int dst_stride, int row0, int row1);
+
+/* Split scale into 2x and 3x passes, returns the number of passes */
+int scale_chain(int scale, int *factors);
+
+/* Multi-pass scaling straight between strided buffers, strides are in
+ * pixels. A threshold above 0 is passed to scale2x_aa for the 2x passes.
+ * Returns 0 on failure. */
+int scale_nx_into(const uint32_t *src, int w, int h, int src_stride,
+                  int scale, int threshold, uint32_t *dst, int dst_stride);
+
+/* Multi-pass scaling to any product of 2s and 3s */
 uint32_t* scale_nx(const uint32_t *src, int w, int h, int scale, int *out_w, int *out_h);
 
+/* Upscaler the zoomed view can be drawn with, chosen per session */
+struct scale_engine {
+    const char *name;
+    const int *factors;  /* Ascending, 0 terminated */
+    int halo;            /* Source pixels read around the upscaled area */
+    void (*init)(void);  /* Run by scale_engine_find, may be NULL */
+    int (*upscale)(const uint32_t *src, int w, int h, int src_stride,
+                   int factor, int threshold, uint32_t *dst, int dst_stride);
+};
+
+/* "epx" for Scale2x/Scale3x chains or "xbr", NULL if unknown. Call it
+ * from one thread before upscaling with the engine. */
+const struct scale_engine *scale_engine_find(const char *name);
+
+/* Upscale a whole surface by 2^passes, the result must be destroyed */
+cairo_surface_t* scale2x_surface(cairo_surface_t *src, int passes);
+
 /* Upscale a viewport region of a Cairo surface using Scale2x
  * Returns a new surface that must be destroyed by caller
  *
@@ -24,3 +83,7 @@ cairo_surface_t* scale2x_viewport(cairo_surface_t *src_surface,
                                    int viewport_x, int viewport_y,
                                    int viewport_w, int viewport_h,
                                    int scale);
+
+/* Surfaces returned above come from a small pool that reuses them once
+ * destroyed by the caller. Releases the pooled ones. */
+void scale_surface_pool_clear(void);
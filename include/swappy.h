@@ -17,6 +17,13 @@
 #define SWAPPY_TRANSPARENCY_MIN 5
 #define SWAPPY_TRANSPARENCY_MAX 95
 
+#define SWAPPY_WORKER_THREADS_MAX 64
+
+#define SWAPPY_ZOOM_AA_THRESHOLD_MAX 255
+
+#define SWAPPY_ENHANCE_SHARPEN_RADIUS_MAX 8
+#define SWAPPY_ENHANCE_SHARPEN_AMOUNT_MAX 500
+
 enum swappy_paint_type {
   SWAPPY_PAINT_MODE_PAN = 0,   /* Pan/drag mode to navigate viewport */
   SWAPPY_PAINT_MODE_BRUSH,     /* Brush mode to draw arbitrary shapes */
@@ -45,6 +52,11 @@ struct swappy_point {
   gdouble y;
 };
 
+struct swappy_stroke_point {
+  gfloat x;
+  gfloat y;
+};
+
 struct swappy_paint_text {
   double r;
   double g;
@@ -57,6 +69,14 @@ struct swappy_paint_text {
   struct swappy_point from;
   struct swappy_point to;
   enum swappy_text_mode mode;
+
+  /* Shaped text cached by render_text, keyed on the fields below */
+  PangoLayout *layout;
+  PangoFontDescription *font_desc;
+  gchar *layout_text;
+  gchar *layout_font;
+  double layout_size;
+  double layout_width;
 };
 
 struct swappy_paint_shape {
@@ -78,7 +98,9 @@ struct swappy_paint_brush {
   double b;
   double a;
   double w;
-  GList *points;
+  struct swappy_stroke_point *points; /* Contiguous, in drawing order */
+  guint n_points;
+  guint n_allocated;
 };
 
 struct swappy_paint_blur {
@@ -89,6 +111,7 @@ struct swappy_paint_blur {
 
 struct swappy_paint {
   enum swappy_paint_type type;
+  guint id; /* Assigned on commit, increases with every committed paint */
   bool can_draw;
   bool is_committed;
   union {
@@ -111,6 +134,18 @@ struct swappy_crop_settings {
   gint aspect_h;   // Aspect ratio height (0 = free)
 };
 
+struct swappy_checkpoint {
+  cairo_surface_t *surface; /* Committed layer with the first `depth` paints */
+  guint depth;
+  guint paint_id; /* Id of the newest paint included in the surface */
+};
+
+struct swappy_tile {
+  struct swappy_box box;
+  bool is_dirty;
+  GList *paints; /* Committed paints intersecting the tile, oldest first */
+};
+
 struct swappy_state_settings {
   double r;
   double g;
@@ -194,7 +229,12 @@ struct swappy_config {
   gboolean early_exit;
   gboolean auto_save;
   char *custom_color;
-  gint8 enhance_preset;  /* Image enhancement level (0=none, 1=subtle, 2=standard, 3=vivid, 4=text) */
+  guint32 worker_threads;
+  guint32 zoom_aa_threshold;
+  char *zoom_engine;
+  gint8 enhance_preset;  /* Image enhancement level (0=none, 1=subtle, 2=standard, 3=vivid, 4=text, 5=auto) */
+  guint32 enhance_sharpen_radius;
+  guint32 enhance_sharpen_amount; /* Percent */
 };
 
 struct swappy_state {
@@ -206,8 +246,32 @@ struct swappy_state {
   GdkPixbuf *original_image;
   cairo_surface_t *original_image_surface;
   cairo_surface_t *rendering_surface;
-  cairo_surface_t *enhanced_surface;  /* Cached preview with enhancement */
-  gint8 enhanced_preset_cache;        /* Which preset the cache was built with */
+  cairo_surface_t *committed_surface;  /* Original image + committed paints */
+  struct swappy_tile *tiles;           /* Tile grid over the committed layer */
+  guint tile_columns;
+  guint tile_rows;
+  guint committed_replay_count;        /* Committed layer replays so far */
+  guint committed_generation;          /* Changes on every committed replay */
+  GList *checkpoints;                  /* Committed layer snapshots, newest first */
+  struct swappy_checkpoint *checkpoint_base; /* Snapshot replays start from */
+  guint checkpoint_pending_paints;     /* Paints committed since last snapshot */
+  gint64 checkpoint_pending_cost;      /* Replay time since last snapshot (us) */
+  struct swappy_box damage;            /* Image area to repaint, accumulated */
+  struct swappy_box temp_paint_bounds; /* Area covered by the drawn temp_paint */
+  cairo_surface_t *stroke_surface;     /* Coverage of the brush being drawn */
+  struct swappy_paint *stroke_paint;   /* Brush accumulated in stroke_surface */
+  guint stroke_n_points;               /* Points already in stroke_surface */
+  gdouble stroke_width;
+  struct swappy_stroke_point stroke_origin;
+  struct swappy_box stroke_bounds;     /* Non-empty area of stroke_surface */
+  struct pixelate_cache *blur_preview_cache; /* Blocks of the blur preview */
+  guint content_generation;            /* Changes whenever the preview does */
+  struct zoom_cache *zoom_cache;       /* Upscaled tiles of the zoomed view */
+  const struct scale_engine *zoom_engine; /* Upscales the zoomed view */
+  guint render_tick_id;                /* Frame clock callback, 0 if none */
+  guint render_pending_events;         /* Input events since last render */
+  struct enhance_cache *enhance_cache; /* Enhanced tiles of the preview */
+  struct enhance_histogram *enhance_histogram; /* For the auto preset */
   cairo_surface_t *upscaled_preview_surface;  /* Cached preview with upscale command */
   gdouble upscaled_preview_scale_x;           /* Source-to-preview width multiplier */
   gdouble upscaled_preview_scale_y;           /* Source-to-preview height multiplier */
@@ -0,0 +1,11 @@
+#pragma once
+
+#include <stdint.h>
+
+/* Build the color space lookup tables, call before xbr_upscale */
+void xbr_init(void);
+
+/* 2xBR upscaling by 2, 4 or 8 between strided ARGB32 buffers, strides are
+ * in pixels. Returns 0 on failure or an unsupported factor. */
+int xbr_upscale(const uint32_t *src, int w, int h, int src_stride,
+                int factor, uint32_t *dst, int dst_stride);
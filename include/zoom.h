@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cairo.h>
+#include <glib.h>
+
+#include "enhance.h"
+#include "scale2x.h"
+#include "swappy.h"
+
+#define ZOOM_TILE_SIZE 64                       /* Source pixels per side */
+#define ZOOM_CACHE_BUDGET (64 * 1024 * 1024)    /* Bytes of upscaled tiles */
+#define ZOOM_POOL_BUDGET (32 * 1024 * 1024)     /* Bytes of spare surfaces */
+
+/*
+ * Upscaled tiles of the displayed surface, least recently used first out.
+ * Tiles are keyed by their position and the zoom factor. They are made
+ * from content `generation`, zoom_cache_damage drops the tiles an edit
+ * reaches and any other new generation drops them all.
+ */
+struct zoom_cache {
+  const struct scale_engine *engine;
+  cairo_surface_t *source;
+  guint generation;
+  gint threshold;    /* Anti-aliasing tolerance the tiles were made with */
+  GHashTable *tiles; /* struct zoom_key -> struct zoom_tile */
+  GQueue lru;        /* Most recently used first */
+  gsize size;        /* Bytes held by the cached tiles */
+  GQueue prewarm;    /* struct zoom_key to upscale when idle */
+  GQueue pool;       /* Surfaces of dropped tiles, to reuse */
+  gsize pool_size;
+  guint prewarm_id;
+  guint hits;
+  guint misses;
+  gboolean is_enhanced;
+  struct enhance_lut enhance; /* Compiled preset of the tiles */
+};
+
+gint zoom_factor_for_scale(const struct scale_engine *engine, double scale);
+void zoom_draw(struct zoom_cache **cache, cairo_t *cr, cairo_surface_t *source,
+               guint generation, struct swappy_box *area,
+               const struct scale_engine *engine, gint factor, gdouble scale,
+               gint threshold, const struct enhance_lut *enhance);
+/* `area` of the source, in source pixels, changed and is now `generation` */
+void zoom_cache_damage(struct zoom_cache *cache, struct swappy_box *area,
+                       guint generation);
+void zoom_cache_free(struct zoom_cache *cache);
@@ -7,15 +7,20 @@
 #include <stdio.h>
 #include <time.h>
 
+#include "box.h"
 #include "clipboard.h"
 #include "config.h"
 #include "enhance.h"
 #include "file.h"
 #include "paint.h"
 #include "pixbuf.h"
+#include "pixelate.h"
+#include "pool.h"
+#include "raster.h"
 #include "render.h"
 #include "scale2x.h"
 #include "swappy.h"
+#include "zoom.h"
 
 // Forward declarations
 static void compute_window_size_and_scaling_factor(struct swappy_state *state);
@@ -166,20 +171,16 @@ static gboolean trigger_async_upscale(gpointer user_data) {
     return G_SOURCE_REMOVE;
   }
 
-  /* Build enhanced surface if needed (may be NULL after render_state cleared it) */
+  /* The preview only enhances what is visible, upscale a full enhanced copy */
   EnhancePreset preset = (EnhancePreset)state->config->enhance_preset;
   if (preset != ENHANCE_NONE) {
-    if (state->enhanced_surface) {
-      source_surface = state->enhanced_surface;
+    temp_enhanced = enhance_surface(state->rendering_surface, preset);
+    if (temp_enhanced && cairo_surface_status(temp_enhanced) == CAIRO_STATUS_SUCCESS) {
+      source_surface = temp_enhanced;
     } else {
-      /* Build a temporary enhanced surface for the upscale */
-      temp_enhanced = enhance_surface(state->rendering_surface, preset);
-      if (temp_enhanced && cairo_surface_status(temp_enhanced) == CAIRO_STATUS_SUCCESS) {
-        source_surface = temp_enhanced;
-      } else {
-        if (temp_enhanced) cairo_surface_destroy(temp_enhanced);
-        source_surface = state->rendering_surface;
-      }
+      if (temp_enhanced) cairo_surface_destroy(temp_enhanced);
+      temp_enhanced = NULL;
+      source_surface = state->rendering_surface;
     }
   } else {
     source_surface = state->rendering_surface;
@@ -422,10 +423,17 @@ void application_finish(struct swappy_state *state) {
   paint_free_all(state);
   pixbuf_free(state);
   cairo_surface_destroy(state->rendering_surface);
+  cairo_surface_destroy(state->committed_surface);
+  raster_free(state);
   cairo_surface_destroy(state->original_image_surface);
-  if (state->enhanced_surface) {
-    cairo_surface_destroy(state->enhanced_surface);
-  }
+  if (state->stroke_surface) {
+    cairo_surface_destroy(state->stroke_surface);
+  }
+  pixelate_cache_free(state->blur_preview_cache);
+  zoom_cache_free(state->zoom_cache);
+  scale_surface_pool_clear();
+  enhance_cache_free(state->enhance_cache);
+  enhance_histogram_free(state->enhance_histogram);
   if (state->upscaled_preview_surface) {
     cairo_surface_destroy(state->upscaled_preview_surface);
   }
@@ -447,6 +455,7 @@ void application_finish(struct swappy_state *state) {
 
   g_object_unref(state->app);
 
+  pool_finish();
   config_free(state);
 }
 
@@ -457,6 +466,7 @@ static void action_undo(struct swappy_state *state) {
     state->paints = g_list_remove_link(state->paints, first);
     state->redo_paints = g_list_prepend(state->redo_paints, first->data);
 
+    render_invalidate_paint(state, first->data);
     render_state(state);
     update_ui_undo_redo(state);
   }
@@ -469,6 +479,7 @@ static void action_redo(struct swappy_state *state) {
     state->redo_paints = g_list_remove_link(state->redo_paints, first);
     state->paints = g_list_prepend(state->paints, first->data);
 
+    render_invalidate_paint(state, first->data);
     render_state(state);
     update_ui_undo_redo(state);
   }
@@ -476,6 +487,7 @@ static void action_redo(struct swappy_state *state) {
 
 static void action_clear(struct swappy_state *state) {
   paint_free_all(state);
+  render_invalidate_committed(state);
   render_state(state);
   update_ui_undo_redo(state);
 }
@@ -872,12 +884,7 @@ void enhance_preset_changed_handler(GtkWidget *widget, struct swappy_state *stat
   gint active = gtk_combo_box_get_active(GTK_COMBO_BOX(widget));
   state->config->enhance_preset = (gint8)active;
 
-  /* Invalidate cached enhanced surface */
-  if (state->enhanced_surface) {
-    cairo_surface_destroy(state->enhanced_surface);
-    state->enhanced_surface = NULL;
-  }
-  state->enhanced_preset_cache = -1;  /* Mark as invalid */
+  /* The preview caches follow the preset, only the upscaled preview is reset */
   invalidate_upscaled_preview_cache(state);
 
   /* Trigger redraw to show preview */
@@ -1194,26 +1201,15 @@ gboolean draw_area_handler(GtkWidget *widget, cairo_t *cr,
   double base_scale_y = (double)alloc->height / image_height;
   gdouble preview_scale_x = 1.0;
   gdouble preview_scale_y = 1.0;
-
-  /* Rebuild enhanced preview if needed */
+  /* Only the visible part is enhanced, at display resolution */
   EnhancePreset preset = (EnhancePreset)state->config->enhance_preset;
-  if (preset != ENHANCE_NONE && state->enhanced_preset_cache != (gint8)preset) {
-    if (state->enhanced_surface) {
-      cairo_surface_destroy(state->enhanced_surface);
-    }
-    state->enhanced_surface = enhance_surface(state->rendering_surface, preset);
-    state->enhanced_preset_cache = preset;
-  }
-
-  /* Choose which surface to display */
-  cairo_surface_t *display_surface = (preset != ENHANCE_NONE && state->enhanced_surface)
-      ? state->enhanced_surface
-      : state->rendering_surface;
+  cairo_surface_t *display_surface = state->rendering_surface;
 
   /* Use cached upscaled preview if available (built asynchronously) */
   if (state->config->upscale_command && state->config->upscale_command[0] != '\0') {
     if (state->upscaled_preview_surface && state->upscaled_preview_cache_valid) {
       display_surface = state->upscaled_preview_surface;
+      preset = ENHANCE_NONE;  /* Built from an enhanced copy */
       if (state->upscaled_preview_scale_x > 0.0) {
         preview_scale_x = state->upscaled_preview_scale_x;
       }
@@ -1224,6 +1220,20 @@ gboolean draw_area_handler(GtkWidget *widget, cairo_t *cr,
     /* Note: async upscale is triggered via debounced invalidate, not here */
   }
 
+  /* The auto preset follows the committed paints, not the one being drawn */
+  struct enhance_lut lut;
+  const struct enhance_lut *enhance = NULL;
+  if (preset != ENHANCE_NONE) {
+    const struct enhance_histogram *histogram = NULL;
+    if (preset == ENHANCE_AUTO) {
+      histogram = enhance_histogram_get(&state->enhance_histogram,
+                                        display_surface,
+                                        state->committed_generation);
+    }
+    enhance_lut_init(&lut, preset, histogram);
+    enhance = &lut;
+  }
+
   // Draw background
   cairo_set_source_rgb(cr, 0.2, 0.2, 0.2);
   cairo_paint(cr);
@@ -1234,54 +1244,45 @@ gboolean draw_area_handler(GtkWidget *widget, cairo_t *cr,
     // Calculate effective scale (base_scale * zoom)
     double effective_scale = base_scale_x * state->zoom_level;
 
-    // Determine Scale2x factor (power of 2: 2, 4, 8...)
-    int scale2x_factor = 2;
-    while (scale2x_factor < effective_scale && scale2x_factor < 8) {
-      scale2x_factor *= 2;
-    }
+    // Upscale factor covering the device pixels, HiDPI screens have more
+    int scale2x_factor = zoom_factor_for_scale(
+        state->zoom_engine,
+        effective_scale * gtk_widget_get_scale_factor(widget));
 
-    // Calculate viewport region in source image coordinates
-    // Account for pan offset and convert screen coords to image coords
-    double inv_scale = 1.0 / (base_scale_x * state->zoom_level);
-    int viewport_x = (int)((-state->pan_x) * inv_scale);
-    int viewport_y = (int)((-state->pan_y) * inv_scale);
-    int viewport_w = (int)(alloc->width * inv_scale) + 2;  // +2 for edge pixels
-    int viewport_h = (int)(alloc->height * inv_scale) + 2;
-
-    // Clamp to image bounds
-    if (viewport_x < 0) viewport_x = 0;
-    if (viewport_y < 0) viewport_y = 0;
-    if (viewport_x + viewport_w > image_width) viewport_w = image_width - viewport_x;
-    if (viewport_y + viewport_h > image_height) viewport_h = image_height - viewport_y;
-
-    if (viewport_w > 0 && viewport_h > 0) {
-      // Upscale the viewport region using Scale2x
-      cairo_surface_t *upscaled = scale2x_viewport(
-        display_surface,
-        viewport_x, viewport_y,
-        viewport_w, viewport_h,
-        scale2x_factor
-      );
-
-      if (upscaled) {
-        // Calculate where to draw the upscaled surface
-        double draw_x = state->pan_x + viewport_x * base_scale_x * state->zoom_level;
-        double draw_y = state->pan_y + viewport_y * base_scale_y * state->zoom_level;
-
-        // Scale factor to fit upscaled surface to screen
-        double final_scale = (base_scale_x * state->zoom_level) / scale2x_factor;
-
-        cairo_save(cr);
-        cairo_translate(cr, draw_x, draw_y);
-        cairo_scale(cr, final_scale, final_scale);
-        cairo_set_source_surface(cr, upscaled, 0, 0);
-        cairo_pattern_set_filter(cairo_get_source(cr), CAIRO_FILTER_NEAREST);
-        cairo_paint(cr);
-        cairo_restore(cr);
-
-        cairo_surface_destroy(upscaled);
-      }
-    }
+    // The upscaled tiles are resampled to fit the screen
+    double final_scale = effective_scale / scale2x_factor;
+
+    cairo_save(cr);
+    cairo_translate(cr, state->pan_x, state->pan_y);
+
+    // Only the tiles under the redrawn area are needed, in image coordinates
+    struct swappy_box visible;
+    gdouble x1, y1, x2, y2;
+    cairo_clip_extents(cr, &x1, &y1, &x2, &y2);
+    box_from_extents(&visible, x1 / effective_scale, y1 / effective_scale,
+                     x2 / effective_scale, y2 / effective_scale, 0);
+
+    zoom_draw(&state->zoom_cache, cr, display_surface,
+              state->content_generation, &visible, state->zoom_engine,
+              scale2x_factor, final_scale,
+              (gint)state->config->zoom_aa_threshold, enhance);
+    cairo_restore(cr);
+  } else if (enhance) {
+    double scale = base_scale_x * state->zoom_level;
+
+    cairo_save(cr);
+    cairo_translate(cr, state->pan_x, state->pan_y);
+
+    // Only the damaged part of the widget needs to be enhanced
+    struct swappy_box visible;
+    gdouble x1, y1, x2, y2;
+    cairo_clip_extents(cr, &x1, &y1, &x2, &y2);
+    box_from_extents(&visible, x1 / scale, y1 / scale, x2 / scale, y2 / scale,
+                     1);
+
+    enhance_draw(&state->enhance_cache, cr, display_surface,
+                 state->content_generation, &visible, enhance, scale);
+    cairo_restore(cr);
   } else {
     // Standard Cairo rendering for low zoom levels
     double scale_x = (base_scale_x * state->zoom_level) / preview_scale_x;
@@ -1351,7 +1352,7 @@ void draw_area_button_press_handler(GtkWidget *widget, GdkEventButton *event,
       case SWAPPY_PAINT_MODE_TEXT:
       case SWAPPY_PAINT_MODE_CROP:
         paint_add_temporary(state, x, y, state->mode);
-        render_state(state);
+        render_state_schedule(state);
         update_ui_undo_redo(state);
         break;
       default:
@@ -1401,7 +1402,7 @@ void draw_area_motion_notify_handler(GtkWidget *widget, GdkEventMotion *event,
     case SWAPPY_PAINT_MODE_LINE:
       if (is_button1_pressed) {
         paint_update_temporary_shape(state, x, y, is_control_pressed);
-        render_state(state);
+        render_state_schedule(state);
       }
       break;
     case SWAPPY_PAINT_MODE_CROP:
@@ -1434,13 +1435,13 @@ void draw_area_motion_notify_handler(GtkWidget *widget, GdkEventMotion *event,
         }
 
         paint_update_temporary_shape(state, crop_x, crop_y, is_control_pressed);
-        render_state(state);
+        render_state_schedule(state);
       }
       break;
     case SWAPPY_PAINT_MODE_TEXT:
       if (is_button1_pressed) {
         paint_update_temporary_text_clip(state, x, y);
-        render_state(state);
+        render_state_schedule(state);
       }
       break;
     default:
@@ -1537,7 +1538,7 @@ gboolean draw_area_scroll_handler(GtkWidget *widget, GdkEventScroll *event,
       }
       if (state->temp_paint && state->temp_paint->type == SWAPPY_PAINT_MODE_TEXT) {
         state->temp_paint->content.text.s = state->settings.t;
-        render_state(state);
+        render_state_schedule(state);
       }
     } else {
       if (direction == GDK_SCROLL_UP) {
@@ -1560,7 +1561,7 @@ gboolean draw_area_scroll_handler(GtkWidget *widget, GdkEventScroll *event,
           default:
             break;
         }
-        render_state(state);
+        render_state_schedule(state);
       }
     }
   } else {
@@ -2036,6 +2037,13 @@ static gint command_line_handler(GtkApplication *app,
                                  struct swappy_state *state) {
   config_load(state);
   init_settings(state);
+  pool_init((gint)state->config->worker_threads);
+  scale_set_parallel(pool_parallel_for, pool_get_n_threads());
+  g_info("zoom kernels use %s", scale_simd_name(scale_simd_get()));
+  state->zoom_engine = scale_engine_find(state->config->zoom_engine);
+  g_info("zoom engine is %s", state->zoom_engine->name);
+  enhance_set_sharpen(state->config->enhance_sharpen_radius,
+                      state->config->enhance_sharpen_amount);
 
   if (has_option_file(state)) {
     if (is_file_from_stdin(state->file_str)) {
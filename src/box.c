@@ -1,5 +1,7 @@
 #include "box.h"
 
+#include <math.h>
+
 static int32_t lmax(int32_t a, int32_t b) { return a > b ? a : b; }
 
 static int32_t lmin(int32_t a, int32_t b) { return a < b ? a : b; }
@@ -54,3 +56,46 @@ bool intersect_box(struct swappy_box *a, struct swappy_box *b) {
   };
   return !is_empty_box(&box);
 }
+
+void union_box(struct swappy_box *box, struct swappy_box *other) {
+  if (is_empty_box(other)) {
+    return;
+  }
+
+  if (is_empty_box(box)) {
+    *box = *other;
+    return;
+  }
+
+  int32_t x1 = lmin(box->x, other->x);
+  int32_t y1 = lmin(box->y, other->y);
+  int32_t x2 = lmax(box->x + box->width, other->x + other->width);
+  int32_t y2 = lmax(box->y + box->height, other->y + other->height);
+
+  box->x = x1;
+  box->y = y1;
+  box->width = x2 - x1;
+  box->height = y2 - y1;
+}
+
+bool clip_box(struct swappy_box *box, struct swappy_box *bounds) {
+  int32_t x1 = lmax(box->x, bounds->x);
+  int32_t y1 = lmax(box->y, bounds->y);
+  int32_t x2 = lmin(box->x + box->width, bounds->x + bounds->width);
+  int32_t y2 = lmin(box->y + box->height, bounds->y + bounds->height);
+
+  box->x = x1;
+  box->y = y1;
+  box->width = lmax(x2 - x1, 0);
+  box->height = lmax(y2 - y1, 0);
+
+  return !is_empty_box(box);
+}
+
+void box_from_extents(struct swappy_box *box, double x1, double y1, double x2,
+                      double y2, double padding) {
+  box->x = (int32_t)floor(fmin(x1, x2) - padding);
+  box->y = (int32_t)floor(fmin(y1, y2) - padding);
+  box->width = (int32_t)ceil(fmax(x1, x2) + padding) - box->x;
+  box->height = (int32_t)ceil(fmax(y1, y2) + padding) - box->y;
+}
@@ -0,0 +1,136 @@
+#include "checkpoint.h"
+
+/*
+ * Checkpoints are snapshots of the committed layer taken every few paints,
+ * or once replaying the layer became expensive. Undo restores the newest
+ * snapshot that is still a prefix of the paint list and only replays the
+ * paints committed after it.
+ *
+ * Paint ids grow with every commit and paints only come and go at the head
+ * of the list, so a snapshot is valid as long as the paint at its depth
+ * still has the id it was taken with.
+ */
+
+static void checkpoint_free(gpointer data) {
+  struct swappy_checkpoint *checkpoint = data;
+
+  cairo_surface_destroy(checkpoint->surface);
+  g_free(checkpoint);
+}
+
+static guint checkpoint_max_count(struct swappy_state *state) {
+  cairo_surface_t *surface = state->committed_surface;
+  gsize size = (gsize)cairo_image_surface_get_stride(surface) *
+               cairo_image_surface_get_height(surface);
+
+  return size > 0 ? CHECKPOINT_MEMORY_BUDGET / size : 0;
+}
+
+/*
+ * Find the deepest checkpoint matching the current paints. Checkpoints that
+ * can never match again are dropped, the ones above the current depth are
+ * kept for redo.
+ */
+struct swappy_checkpoint *checkpoint_find(struct swappy_state *state) {
+  guint length = g_list_length(state->paints);
+  GList *elem = state->checkpoints;
+
+  while (elem) {
+    GList *next = elem->next;
+    struct swappy_checkpoint *checkpoint = elem->data;
+
+    if (checkpoint->depth <= length) {
+      struct swappy_paint *paint =
+          g_list_nth_data(state->paints, length - checkpoint->depth);
+
+      if (paint->id == checkpoint->paint_id) {
+        return checkpoint;
+      }
+
+      state->checkpoints = g_list_delete_link(state->checkpoints, elem);
+      checkpoint_free(checkpoint);
+    }
+
+    elem = next;
+  }
+
+  return NULL;
+}
+
+/*
+ * Called once the committed layer is up to date with every paint, take a
+ * new snapshot when enough paints or replay time accumulated since the last
+ * one.
+ */
+void checkpoint_update(struct swappy_state *state, gint64 replay_cost) {
+  state->checkpoint_pending_cost += replay_cost;
+
+  if (state->paints == NULL ||
+      (state->checkpoint_pending_paints < CHECKPOINT_PAINT_INTERVAL &&
+       state->checkpoint_pending_cost < CHECKPOINT_COST_INTERVAL_US)) {
+    return;
+  }
+
+  struct swappy_paint *newest = state->paints->data;
+  struct swappy_checkpoint *latest =
+      state->checkpoints ? state->checkpoints->data : NULL;
+
+  state->checkpoint_pending_paints = 0;
+  state->checkpoint_pending_cost = 0;
+
+  if (latest && latest->paint_id == newest->id) {
+    return;
+  }
+
+  guint max_count = checkpoint_max_count(state);
+
+  if (max_count == 0) {
+    return;
+  }
+
+  // Evict the oldest snapshots, the newest ones serve undo first
+  while (g_list_length(state->checkpoints) >= max_count) {
+    GList *last = g_list_last(state->checkpoints);
+    if (state->checkpoint_base == last->data) {
+      state->checkpoint_base = NULL;
+    }
+    checkpoint_free(last->data);
+    state->checkpoints = g_list_delete_link(state->checkpoints, last);
+  }
+
+  cairo_surface_t *committed = state->committed_surface;
+  cairo_surface_t *surface = cairo_image_surface_create(
+      cairo_image_surface_get_format(committed),
+      cairo_image_surface_get_width(committed),
+      cairo_image_surface_get_height(committed));
+
+  if (cairo_surface_status(surface)) {
+    g_warning("unable to create checkpoint surface");
+    cairo_surface_destroy(surface);
+    return;
+  }
+
+  cairo_t *cr = cairo_create(surface);
+  cairo_set_source_surface(cr, committed, 0, 0);
+  cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+  cairo_paint(cr);
+  cairo_destroy(cr);
+
+  struct swappy_checkpoint *checkpoint = g_new(struct swappy_checkpoint, 1);
+  checkpoint->surface = surface;
+  checkpoint->depth = g_list_length(state->paints);
+  checkpoint->paint_id = newest->id;
+
+  state->checkpoints = g_list_prepend(state->checkpoints, checkpoint);
+
+  g_debug("checkpoint taken at depth %u (%u checkpoints)", checkpoint->depth,
+          g_list_length(state->checkpoints));
+}
+
+void checkpoint_free_all(struct swappy_state *state) {
+  g_list_free_full(state->checkpoints, checkpoint_free);
+  state->checkpoints = NULL;
+  state->checkpoint_base = NULL;
+  state->checkpoint_pending_paints = 0;
+  state->checkpoint_pending_cost = 0;
+}
@@ -7,7 +7,9 @@
 #include <sys/stat.h>
 #include <wordexp.h>
 
+#include "enhance.h"
 #include "file.h"
+#include "scale2x.h"
 #include "swappy.h"
 
 static void print_config(struct swappy_config *config) {
@@ -26,6 +28,13 @@ static void print_config(struct swappy_config *config) {
   g_info("auto_save: %d", config->auto_save);
   g_info("custom_color: %s", config->custom_color);
   g_info("transparent: %d", config->transparent);
+  g_info("worker_threads: %d", config->worker_threads);
+  g_info("zoom_aa_threshold: %d", config->zoom_aa_threshold);
+  g_info("zoom_engine: %s", config->zoom_engine);
+  g_info("enhance_preset: %s",
+         enhance_preset_name((EnhancePreset)config->enhance_preset));
+  g_info("enhance_sharpen_radius: %d", config->enhance_sharpen_radius);
+  g_info("enhance_sharpen_amount: %d", config->enhance_sharpen_amount);
 }
 
 static char *get_default_save_dir() {
@@ -89,6 +98,12 @@ static void load_config_from_file(struct swappy_config *config,
   gboolean auto_save;
   gchar *custom_color = NULL;
   gboolean transparent;
+  guint64 worker_threads;
+  guint64 zoom_aa_threshold;
+  gchar *zoom_engine = NULL;
+  gchar *enhance_preset = NULL;
+  guint64 enhance_sharpen_radius;
+  guint64 enhance_sharpen_amount;
   GError *error = NULL;
 
   if (file == NULL) {
@@ -287,6 +302,117 @@ static void load_config_from_file(struct swappy_config *config,
     error = NULL;
   }
 
+  worker_threads = g_key_file_get_uint64(gkf, group, "worker_threads", &error);
+
+  if (error == NULL) {
+    if (worker_threads <= SWAPPY_WORKER_THREADS_MAX) {
+      config->worker_threads = worker_threads;
+    } else {
+      g_warning("worker_threads is not a valid value: %" PRIu64
+                " - see man page for details",
+                worker_threads);
+    }
+  } else {
+    g_info("worker_threads is missing in %s (%s)", file, error->message);
+    g_error_free(error);
+    error = NULL;
+  }
+
+  zoom_aa_threshold =
+      g_key_file_get_uint64(gkf, group, "zoom_aa_threshold", &error);
+
+  if (error == NULL) {
+    if (zoom_aa_threshold <= SWAPPY_ZOOM_AA_THRESHOLD_MAX) {
+      config->zoom_aa_threshold = zoom_aa_threshold;
+    } else {
+      g_warning("zoom_aa_threshold is not a valid value: %" PRIu64
+                " - see man page for details",
+                zoom_aa_threshold);
+    }
+  } else {
+    g_info("zoom_aa_threshold is missing in %s (%s)", file, error->message);
+    g_error_free(error);
+    error = NULL;
+  }
+
+  zoom_engine = g_key_file_get_string(gkf, group, "zoom_engine", &error);
+
+  if (error == NULL) {
+    if (scale_engine_find(zoom_engine)) {
+      g_free(config->zoom_engine);
+      config->zoom_engine = zoom_engine;
+    } else {
+      g_warning(
+          "zoom_engine is not a valid value: %s - see man page for details",
+          zoom_engine);
+      g_free(zoom_engine);
+    }
+  } else {
+    g_info("zoom_engine is missing in %s (%s)", file, error->message);
+    g_error_free(error);
+    error = NULL;
+  }
+
+  enhance_preset = g_key_file_get_string(gkf, group, "enhance_preset", &error);
+
+  if (error == NULL) {
+    EnhancePreset preset = ENHANCE_NONE;
+
+    while (preset < ENHANCE_N_PRESETS &&
+           g_strcmp0(enhance_preset, enhance_preset_name(preset)) != 0) {
+      preset++;
+    }
+
+    if (preset < ENHANCE_N_PRESETS) {
+      config->enhance_preset = (gint8)preset;
+    } else {
+      g_warning(
+          "enhance_preset is not a valid value: %s - see man page for details",
+          enhance_preset);
+    }
+    g_free(enhance_preset);
+  } else {
+    g_info("enhance_preset is missing in %s (%s)", file, error->message);
+    g_error_free(error);
+    error = NULL;
+  }
+
+  enhance_sharpen_radius =
+      g_key_file_get_uint64(gkf, group, "enhance_sharpen_radius", &error);
+
+  if (error == NULL) {
+    if (enhance_sharpen_radius <= SWAPPY_ENHANCE_SHARPEN_RADIUS_MAX) {
+      config->enhance_sharpen_radius = enhance_sharpen_radius;
+    } else {
+      g_warning("enhance_sharpen_radius is not a valid value: %" PRIu64
+                " - see man page for details",
+                enhance_sharpen_radius);
+    }
+  } else {
+    g_info("enhance_sharpen_radius is missing in %s (%s)", file,
+           error->message);
+    g_error_free(error);
+    error = NULL;
+  }
+
+  enhance_sharpen_amount =
+      g_key_file_get_uint64(gkf, group, "enhance_sharpen_amount", &error);
+
+  if (error == NULL) {
+    if (enhance_sharpen_amount <= SWAPPY_ENHANCE_SHARPEN_AMOUNT_MAX) {
+      config->enhance_sharpen_amount = enhance_sharpen_amount;
+    } else {
+      g_warning("enhance_sharpen_amount is not a valid value: %" PRIu64
+                " - see man page for details",
+                enhance_sharpen_amount);
+    }
+  } else {
+    g_info("enhance_sharpen_amount is missing in %s (%s)", file,
+           error->message);
+    g_error_free(error);
+    error = NULL;
+  }
+
   g_key_file_free(gkf);
 }
 
@@ -308,6 +434,13 @@ static void load_default_config(struct swappy_config *config) {
   config->custom_color = g_strdup(CONFIG_CUSTOM_COLOR_DEFAULT);
   config->transparent = CONFIG_TRANSPARENT_DEFAULT;
   config->transparency = CONFIG_TRANSPARENCY_DEFAULT;
+  config->worker_threads = CONFIG_WORKER_THREADS_DEFAULT;
+  config->zoom_aa_threshold = CONFIG_ZOOM_AA_THRESHOLD_DEFAULT;
+  config->zoom_engine = g_strdup(CONFIG_ZOOM_ENGINE_DEFAULT);
+  config->enhance_preset = CONFIG_ENHANCE_PRESET_DEFAULT;
+  config->enhance_sharpen_radius = CONFIG_ENHANCE_SHARPEN_RADIUS_DEFAULT;
+  config->enhance_sharpen_amount = CONFIG_ENHANCE_SHARPEN_AMOUNT_DEFAULT;
+  config->upscale_command = NULL;
 }
 
 void config_load(struct swappy_state *state) {
@@ -335,6 +468,7 @@ void config_free(struct swappy_state *state) {
     g_free(state->config->save_filename_format);
     g_free(state->config->text_font);
     g_free(state->config->custom_color);
+    g_free(state->config->zoom_engine);
     g_free(state->config);
     state->config = NULL;
   }
@@ -0,0 +1,1105 @@
+#include "enhance.h"
+
+#include <math.h>
+#include <string.h>
+
+#include "box.h"
+#include "pool.h"
+#include "resample.h"
+#include "scale2x.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define ENHANCE_HAVE_SSE2 1
+#include <immintrin.h>
+#endif
+
+/*
+ * Tone and color enhancement of the image.
+ *
+ * The tone curve of a preset (levels, gamma, then an S-curve for contrast)
+ * only depends on the channel value, so it is compiled into a 256-entry
+ * table applied to unpremultiplied channels. Saturation mixes the channels
+ * with the luma of the pixel. It is linear, so it runs on the premultiplied
+ * pixels directly, clamped to alpha, four pixels at a time with SSE2. Both
+ * paths round the same way and produce the same output.
+ *
+ * The text preset then sharpens glyph edges with an unsharp mask. The
+ * toned pixels are blurred by a Gaussian in two separable passes, along
+ * rows then down columns, with the blend of the area resampler, and the
+ * difference with the blur is added back by the same mix as saturation.
+ * The mask reads the radius around each pixel, so every area is enhanced
+ * from its own margin and areas made apart match the whole image.
+ *
+ * The auto preset takes its levels from the histogram of the image: each
+ * channel is stretched between the values clipping ENHANCE_AUTO_CLIP of
+ * the pixels at each end, then a gamma brings the mean luma closer to the
+ * middle. The histogram is counted in parallel, one partial histogram per
+ * worker, merged at the end, and is kept until the content changes.
+ *
+ * The export enhances the whole image in square blocks, small enough for
+ * the blur passes to stay in cache, run in parallel on the worker pool.
+ * Presets without the mask take bands of whole rows instead, tone and
+ * saturation done in one pass over each row, eight pixels at a time with
+ * AVX2 gathering the table entries.
+ * The preview only enhances what is on screen: the visible tiles are
+ * area-averaged to device pixels first, so the cost follows the size of
+ * the view rather than the size of the image, and the mask sharpens what
+ * is displayed. After an edit only the device pixels whose area, widened
+ * by the sharpening radius, reaches the damaged source pixels are made
+ * again.
+ */
+
+#define ENHANCE_BLOCK_SIZE 128 /* Pixels per side of the export blocks */
+#define ENHANCE_AUTO_CLIP 0.005     /* Pixels clipped at each end */
+#define ENHANCE_AUTO_MIN_RANGE 64   /* Channel values stretched to 0-255 */
+#define ENHANCE_AUTO_GAMMA_MIN 0.67
+#define ENHANCE_AUTO_GAMMA_MAX 1.5
+
+struct enhance_params {
+  const char *name;
+  gdouble black;      /* Input levels mapped to 0 and 1 */
+  gdouble white;
+  gdouble gamma;      /* Above 1 brightens the midtones */
+  gdouble contrast;   /* S-curve strength, 0 to 1 */
+  gdouble saturation; /* 1 keeps the colors */
+};
+
+static const struct enhance_params presets[ENHANCE_N_PRESETS] = {
+    [ENHANCE_NONE] = {"none", 0.0, 1.0, 1.0, 0.0, 1.0},
+    [ENHANCE_SUBTLE] = {"subtle", 0.01, 0.99, 1.0, 0.15, 1.05},
+    [ENHANCE_STANDARD] = {"standard", 0.02, 0.98, 1.05, 0.3, 1.12},
+    [ENHANCE_VIVID] = {"vivid", 0.03, 0.97, 1.05, 0.5, 1.35},
+    // Darker midtones thicken thin glyph strokes
+    [ENHANCE_TEXT] = {"text", 0.06, 0.94, 0.9, 0.6, 1.0},
+    // Levels and gamma come from the histogram
+    [ENHANCE_AUTO] = {"auto", 0.0, 1.0, 1.0, 0.0, 1.0},
+};
+
+struct enhance_job {
+  const struct enhance_lut *lut;
+  gboolean opaque;
+  const guint32 *src;
+  gint src_stride; /* In pixels */
+  guint32 *dst;
+  gint dst_stride;
+  gint width;
+  gint height;
+  gint block_width;
+  gint columns;
+  gint failed;
+};
+
+// Partial histogram of the rows counted by one worker, one for even and one
+// for odd pixels so that consecutive increments rarely hit the same counter
+struct enhance_counts {
+  guint32 counts[2][3][256];
+};
+
+struct enhance_histogram_job {
+  const guchar *data;
+  gint stride;
+  gint width;
+  gint height;
+  gboolean opaque;
+  guint n_jobs;
+  struct enhance_counts *bands;
+};
+
+// Tiles of the preview cache to make, in parallel
+struct enhance_tile_job {
+  struct enhance_cache *cache;
+  const guint32 *src;
+  gint src_width;
+  gint src_height;
+  gint src_stride; /* In pixels */
+  gboolean opaque;
+  guint *tiles;
+};
+
+// Unsharp mask of the text preset, set from the config at startup
+static guint sharpen_radius = 1;
+static guint sharpen_amount = 100;
+
+static guint8 unpremultiply(guint32 value, guint32 alpha) {
+  return (guint8)MIN((value * 255 + alpha / 2) / alpha, 255);
+}
+
+static void histogram_band(guint index, gpointer data) {
+  struct enhance_histogram_job *job = data;
+  guint32(*counts)[3][256] = job->bands[index].counts;
+  gint row0 = (gint)((gint64)job->height * index / job->n_jobs);
+  gint row1 = (gint)((gint64)job->height * (index + 1) / job->n_jobs);
+
+  for (gint y = row0; y < row1; y++) {
+    const guint32 *row = (const guint32 *)(job->data + (gsize)y * job->stride);
+
+    for (gint x = 0; x < job->width; x++) {
+      guint32 p = row[x];
+      guint32 a = job->opaque ? 255 : p >> 24;
+      guint32(*count)[256] = counts[x & 1];
+
+      if (a == 255) {
+        count[0][p & 0xff]++;
+        count[1][(p >> 8) & 0xff]++;
+        count[2][(p >> 16) & 0xff]++;
+      } else if (a > 0) {
+        count[0][unpremultiply(p & 0xff, a)]++;
+        count[1][unpremultiply((p >> 8) & 0xff, a)]++;
+        count[2][unpremultiply((p >> 16) & 0xff, a)]++;
+      }
+    }
+  }
+}
+
+static void histogram_count(struct enhance_histogram *histogram,
+                            cairo_surface_t *source) {
+  struct enhance_histogram_job job = {
+      .data = cairo_image_surface_get_data(source),
+      .stride = cairo_image_surface_get_stride(source),
+      .width = cairo_image_surface_get_width(source),
+      .height = cairo_image_surface_get_height(source),
+      .opaque = cairo_image_surface_get_format(source) == CAIRO_FORMAT_RGB24,
+      .n_jobs = MAX(pool_get_n_threads(), 1),
+  };
+  gint64 start = g_get_monotonic_time();
+
+  job.bands = g_new0(struct enhance_counts, job.n_jobs);
+  pool_parallel_for(job.n_jobs, histogram_band, &job);
+
+  memset(histogram->counts, 0, sizeof(histogram->counts));
+  for (guint j = 0; j < job.n_jobs; j++) {
+    for (gint k = 0; k < 2; k++) {
+      for (gint c = 0; c < 3; c++) {
+        for (gint i = 0; i < 256; i++) {
+          histogram->counts[c][i] += job.bands[j].counts[k][c][i];
+        }
+      }
+    }
+  }
+
+  histogram->total = 0;
+  for (gint i = 0; i < 256; i++) {
+    histogram->total += histogram->counts[0][i];
+  }
+
+  g_free(job.bands);
+  g_debug("enhance histogram of %dx%d counted in %" G_GINT64_FORMAT "us",
+          job.width, job.height, g_get_monotonic_time() - start);
+}
+
+const struct enhance_histogram *
+enhance_histogram_get(struct enhance_histogram **histogram,
+                      cairo_surface_t *source, guint generation) {
+  struct enhance_histogram *current = *histogram;
+
+  cairo_format_t format = cairo_image_surface_get_format(source);
+  if (format != CAIRO_FORMAT_ARGB32 && format != CAIRO_FORMAT_RGB24) {
+    return NULL;
+  }
+
+  if (!current) {
+    current = g_new0(struct enhance_histogram, 1);
+    *histogram = current;
+  }
+
+  if (current->source == source && current->generation == generation) {
+    return current;
+  }
+
+  cairo_surface_flush(source);
+  histogram_count(current, source);
+
+  if (current->source) {
+    cairo_surface_destroy(current->source);
+  }
+  current->source = cairo_surface_reference(source);
+  current->generation = generation;
+
+  return current;
+}
+
+void enhance_histogram_free(struct enhance_histogram *histogram) {
+  if (!histogram) {
+    return;
+  }
+
+  if (histogram->source) {
+    cairo_surface_destroy(histogram->source);
+  }
+  g_free(histogram);
+}
+
+// Channel value past `fraction` of the pixels, from the dark or light end
+static gint histogram_percentile(const guint64 *counts, guint64 total,
+                                 gdouble fraction, gboolean from_light) {
+  guint64 clip = (guint64)(total * fraction);
+  guint64 sum = 0;
+
+  for (gint i = 0; i < 256; i++) {
+    gint value = from_light ? 255 - i : i;
+
+    sum += counts[value];
+    if (sum > clip) {
+      return value;
+    }
+  }
+  return from_light ? 255 : 0;
+}
+
+static void auto_levels(const struct enhance_histogram *histogram,
+                        gdouble *black, gdouble *white, gdouble *gamma) {
+  static const gdouble luma[3] = {29 / 256.0, 150 / 256.0, 77 / 256.0};
+  gdouble mean = 0;
+
+  if (histogram->total == 0) {
+    return;
+  }
+
+  for (gint c = 0; c < 3; c++) {
+    const guint64 *counts = histogram->counts[c];
+    gint low = histogram_percentile(counts, histogram->total,
+                                    ENHANCE_AUTO_CLIP, FALSE);
+    gint high = histogram_percentile(counts, histogram->total,
+                                     ENHANCE_AUTO_CLIP, TRUE);
+
+    // Nearly flat channels are only stretched so far
+    if (high - low < ENHANCE_AUTO_MIN_RANGE) {
+      gint middle = CLAMP((low + high) / 2, ENHANCE_AUTO_MIN_RANGE / 2,
+                          255 - ENHANCE_AUTO_MIN_RANGE / 2);
+
+      low = middle - ENHANCE_AUTO_MIN_RANGE / 2;
+      high = middle + ENHANCE_AUTO_MIN_RANGE / 2;
+    }
+    black[c] = low / 255.0;
+    white[c] = high / 255.0;
+
+    gdouble sum = 0;
+    for (gint i = 0; i < 256; i++) {
+      gdouble x = (i / 255.0 - black[c]) / (white[c] - black[c]);
+
+      sum += counts[i] * CLAMP(x, 0.0, 1.0);
+    }
+    mean += luma[c] * sum / histogram->total;
+  }
+
+  // Halfway, in log space, from the mean luma to the middle
+  if (mean > 0 && mean < 1) {
+    *gamma = CLAMP(sqrt(log(mean) / log(0.5)), ENHANCE_AUTO_GAMMA_MIN,
+                   ENHANCE_AUTO_GAMMA_MAX);
+  }
+}
+
+void enhance_set_sharpen(guint radius, guint amount) {
+  sharpen_radius = MIN(radius, SWAPPY_ENHANCE_SHARPEN_RADIUS_MAX);
+  sharpen_amount = amount;
+}
+
+// Gaussian of sigma radius / 2, in 8.8 weights rounded from the running sum
+// so that they add up to exactly 256
+static void sharpen_init(struct enhance_lut *lut, gint radius, guint amount) {
+  gdouble weights[2 * SWAPPY_ENHANCE_SHARPEN_RADIUS_MAX + 1];
+  gdouble sigma = radius / 2.0;
+  gdouble sum = 0, total = 0;
+  gint n = 2 * radius + 1;
+  gint done = 0;
+
+  for (gint k = 0; k < n; k++) {
+    weights[k] = exp(-(k - radius) * (k - radius) / (2 * sigma * sigma));
+    sum += weights[k];
+  }
+
+  for (gint k = 0; k < n; k++) {
+    total += weights[k];
+
+    gint next = (gint)lround(total / sum * 256);
+    lut->sharpen_weights[k] = (guint16)(next - done);
+    done = next;
+  }
+
+  lut->sharpen_radius = radius;
+  lut->sharpen_amount = (gint)lround(amount * 256 / 100.0);
+}
+
+void enhance_lut_init(struct enhance_lut *lut, EnhancePreset preset,
+                      const struct enhance_histogram *histogram) {
+  const struct enhance_params *params = &presets[preset];
+  gdouble black[3] = {params->black, params->black, params->black};
+  gdouble white[3] = {params->white, params->white, params->white};
+  gdouble gamma = params->gamma;
+
+  // Caches compare compiled presets byte for byte, padding included
+  memset(lut, 0, sizeof(struct enhance_lut));
+
+  if (preset == ENHANCE_AUTO && histogram) {
+    auto_levels(histogram, black, white, &gamma);
+  }
+
+  for (gint c = 0; c < 3; c++) {
+    for (gint i = 0; i < 256; i++) {
+      gdouble x = (i / 255.0 - black[c]) / (white[c] - black[c]);
+
+      x = CLAMP(x, 0.0, 1.0);
+      x = pow(x, 1.0 / gamma);
+      x += params->contrast * (x * x * (3 - 2 * x) - x);
+      lut->tone[c][i] = (guint32)lround(CLAMP(x, 0.0, 1.0) * 255) << (8 * c);
+    }
+  }
+  lut->saturation = (gint)lround(params->saturation * 256);
+
+  if (preset == ENHANCE_TEXT && sharpen_radius > 0 && sharpen_amount > 0) {
+    sharpen_init(lut, (gint)sharpen_radius, sharpen_amount);
+  }
+}
+
+static inline guint32 premultiply(guint32 value, guint32 alpha) {
+  guint32 t = value * alpha + 128;
+
+  return (t + (t >> 8)) >> 8;
+}
+
+static void tone_row(const guint32 (*lut)[256], const guint32 *src,
+                     guint32 *dst, gint width, gboolean opaque) {
+  for (gint x = 0; x < width; x++) {
+    guint32 p = src[x];
+    guint32 a = opaque ? 255 : p >> 24;
+
+    if (a == 255) {
+      dst[x] = 0xff000000 | lut[2][(p >> 16) & 0xff] |
+               lut[1][(p >> 8) & 0xff] | lut[0][p & 0xff];
+    } else if (a == 0) {
+      dst[x] = 0;
+    } else {
+      guint32 out = a << 24;
+
+      for (gint c = 0; c < 3; c++) {
+        guint8 value = unpremultiply((p >> (8 * c)) & 0xff, a);
+
+        out |= premultiply(lut[c][value] >> (8 * c), a) << (8 * c);
+      }
+      dst[x] = out;
+    }
+  }
+}
+
+#ifdef ENHANCE_HAVE_SSE2
+/*
+ * base + ((px - base) * factor + 128) >> 8 for the two pixels unpacked to
+ * 16-bit lanes in px, factor being pairs of the 8.8 factor and 128
+ */
+__attribute__((target("sse2"))) static inline __m128i
+mix_pixels_sse2(__m128i px, __m128i base, __m128i factor) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i one = _mm_set1_epi16(1);
+  const __m128i alpha_mask = _mm_setr_epi16(0, 0, 0, -1, 0, 0, 0, -1);
+
+  // In 32 bits
+  __m128i delta = _mm_sub_epi16(px, base);
+  __m128i lo = _mm_srai_epi32(
+      _mm_madd_epi16(_mm_unpacklo_epi16(delta, one), factor), 8);
+  __m128i hi = _mm_srai_epi32(
+      _mm_madd_epi16(_mm_unpackhi_epi16(delta, one), factor), 8);
+  __m128i out = _mm_add_epi16(base, _mm_packs_epi32(lo, hi));
+
+  // Premultiplied channels stay within alpha, alpha is kept
+  __m128i alpha = _mm_shufflehi_epi16(
+      _mm_shufflelo_epi16(px, _MM_SHUFFLE(3, 3, 3, 3)), _MM_SHUFFLE(3, 3, 3, 3));
+  out = _mm_min_epi16(_mm_max_epi16(out, zero), alpha);
+
+  return _mm_or_si128(_mm_andnot_si128(alpha_mask, out),
+                      _mm_and_si128(alpha_mask, px));
+}
+
+/* Saturation of the two pixels unpacked to 16-bit lanes in px */
+__attribute__((target("sse2"))) static inline __m128i
+saturate_pixels_sse2(__m128i px, __m128i factor) {
+  const __m128i weights = _mm_setr_epi16(29, 150, 77, 0, 29, 150, 77, 0);
+
+  // Luma of each pixel, repeated in its four lanes
+  __m128i sums = _mm_madd_epi16(px, weights);
+  __m128i luma = _mm_add_epi32(
+      sums, _mm_shuffle_epi32(sums, _MM_SHUFFLE(2, 3, 0, 1)));
+  luma = _mm_srli_epi32(_mm_add_epi32(luma, _mm_set1_epi32(128)), 8);
+  luma = _mm_packs_epi32(luma, luma);
+  luma = _mm_unpacklo_epi16(luma, luma);
+
+  return mix_pixels_sse2(px, luma, factor);
+}
+
+/* Returns the pixels done, a multiple of four */
+__attribute__((target("sse2"))) static gint
+saturate_row_sse2(guint32 *row, gint width, gint saturation) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i factor = _mm_setr_epi16(saturation, 128, saturation, 128,
+                                        saturation, 128, saturation, 128);
+  gint x = 0;
+
+  for (; x + 4 <= width; x += 4) {
+    __m128i p = _mm_loadu_si128((const __m128i *)(row + x));
+    __m128i lo = saturate_pixels_sse2(_mm_unpacklo_epi8(p, zero), factor);
+    __m128i hi = saturate_pixels_sse2(_mm_unpackhi_epi8(p, zero), factor);
+
+    _mm_storeu_si128((__m128i *)(row + x), _mm_packus_epi16(lo, hi));
+  }
+
+  return x;
+}
+
+/* Returns the pixels done, a multiple of four */
+__attribute__((target("sse2"))) static gint
+sharpen_row_sse2(const guint32 *src, const guint32 *blur, guint32 *dst,
+                 gint width, gint factor) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i factors =
+      _mm_setr_epi16(factor, 128, factor, 128, factor, 128, factor, 128);
+  gint x = 0;
+
+  for (; x + 4 <= width; x += 4) {
+    __m128i p = _mm_loadu_si128((const __m128i *)(src + x));
+    __m128i b = _mm_loadu_si128((const __m128i *)(blur + x));
+    __m128i lo = mix_pixels_sse2(_mm_unpacklo_epi8(p, zero),
+                                 _mm_unpacklo_epi8(b, zero), factors);
+    __m128i hi = mix_pixels_sse2(_mm_unpackhi_epi8(p, zero),
+                                 _mm_unpackhi_epi8(b, zero), factors);
+
+    _mm_storeu_si128((__m128i *)(dst + x), _mm_packus_epi16(lo, hi));
+  }
+
+  return x;
+}
+
+/*
+ * Saturation of the four pixels unpacked to 16-bit lanes in px, as
+ * c + ((c - luma) * factor + 128) >> 8 with factor the 8.8 saturation less
+ * one, 0 in the alpha lanes. That is the mix of saturate_pixels_sse2 while
+ * the product fits 16 bits. Channels under 0 are left to the pack, only
+ * pixels not all opaque need the clamp to alpha.
+ */
+__attribute__((target("avx2"))) static inline __m256i
+saturate_pixels_avx2(__m256i px, __m256i factors, gboolean opaque) {
+  const __m256i weights = _mm256_setr_epi16(29, 150, 77, 0, 29, 150, 77, 0,
+                                            29, 150, 77, 0, 29, 150, 77, 0);
+
+  __m256i sums = _mm256_madd_epi16(px, weights);
+  __m256i luma = _mm256_add_epi32(
+      sums, _mm256_shuffle_epi32(sums, _MM_SHUFFLE(2, 3, 0, 1)));
+  luma = _mm256_srli_epi32(_mm256_add_epi32(luma, _mm256_set1_epi32(128)), 8);
+  luma = _mm256_or_si256(luma, _mm256_slli_epi32(luma, 16));
+
+  __m256i delta = _mm256_mullo_epi16(_mm256_sub_epi16(px, luma), factors);
+  __m256i out = _mm256_add_epi16(
+      px, _mm256_srai_epi16(
+              _mm256_add_epi16(delta, _mm256_set1_epi16(128)), 8));
+
+  if (!opaque) {
+    out = _mm256_min_epi16(
+        out, _mm256_shufflehi_epi16(
+                 _mm256_shufflelo_epi16(px, _MM_SHUFFLE(3, 3, 3, 3)),
+                 _MM_SHUFFLE(3, 3, 3, 3)));
+  }
+
+  return out;
+}
+
+/*
+ * Tone then saturation in one pass, eight pixels at a time with the table
+ * lookups gathered. `factor` is the saturation less 256, within -127 and
+ * 127 so that saturate_pixels_avx2 does not overflow, 0 for none. Pixels
+ * not all opaque are toned by tone_row. Returns the pixels done, a
+ * multiple of eight.
+ */
+__attribute__((target("avx2"))) static gint
+enhance_row_avx2(const guint32 (*lut)[256], const guint32 *src, guint32 *dst,
+                 gint width, gint factor, gboolean opaque) {
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i bytes = _mm256_set1_epi32(0xff);
+  const __m256i alpha = _mm256_set1_epi32((gint)0xff000000);
+  const __m256i factors =
+      _mm256_setr_epi16(factor, factor, factor, 0, factor, factor, factor, 0,
+                        factor, factor, factor, 0, factor, factor, factor, 0);
+  gint x = 0;
+
+  for (; x + 8 <= width; x += 8) {
+    __m256i p = _mm256_loadu_si256((const __m256i *)(src + x));
+    gboolean all_opaque =
+        opaque || _mm256_movemask_epi8(_mm256_cmpeq_epi32(
+                      _mm256_and_si256(p, alpha), alpha)) == -1;
+    __m256i t;
+
+    if (all_opaque) {
+      __m256i b = _mm256_i32gather_epi32((const int *)lut[0],
+                                         _mm256_and_si256(p, bytes), 4);
+      __m256i g = _mm256_i32gather_epi32(
+          (const int *)lut[1],
+          _mm256_and_si256(_mm256_srli_epi32(p, 8), bytes), 4);
+      __m256i r = _mm256_i32gather_epi32(
+          (const int *)lut[2],
+          _mm256_and_si256(_mm256_srli_epi32(p, 16), bytes), 4);
+
+      t = _mm256_or_si256(_mm256_or_si256(b, g), _mm256_or_si256(r, alpha));
+    } else {
+      tone_row(lut, src + x, dst + x, 8, FALSE);
+      t = _mm256_loadu_si256((const __m256i *)(dst + x));
+    }
+
+    if (factor != 0) {
+      __m256i lo = saturate_pixels_avx2(_mm256_unpacklo_epi8(t, zero),
+                                        factors, all_opaque);
+      __m256i hi = saturate_pixels_avx2(_mm256_unpackhi_epi8(t, zero),
+                                        factors, all_opaque);
+
+      t = _mm256_packus_epi16(lo, hi);
+    }
+    _mm256_storeu_si256((__m256i *)(dst + x), t);
+  }
+
+  return x;
+}
+#endif
+
+/* Same as mix_pixels_sse2 on one packed pixel */
+static inline guint32 mix_pixel(guint32 p, guint32 base, gint factor) {
+  gint a = p >> 24;
+  guint32 out = (guint32)a << 24;
+
+  for (gint shift = 0; shift < 24; shift += 8) {
+    gint c = (p >> shift) & 0xff;
+    gint b = (base >> shift) & 0xff;
+    gint value = b + (((c - b) * factor + 128) >> 8);
+
+    out |= (guint32)CLAMP(value, 0, a) << shift;
+  }
+
+  return out;
+}
+
+static void saturate_row(guint32 *row, gint width, gint saturation) {
+  gint x = 0;
+
+#ifdef ENHANCE_HAVE_SSE2
+  if (scale_simd_get() >= SCALE_SIMD_SSE2) {
+    x = saturate_row_sse2(row, width, saturation);
+  }
+#endif
+
+  for (; x < width; x++) {
+    guint32 p = row[x];
+    guint32 luma = (29 * (p & 0xff) + 150 * ((p >> 8) & 0xff) +
+                    77 * ((p >> 16) & 0xff) + 128) >>
+                   8;
+
+    row[x] = mix_pixel(p, luma * 0x010101, saturation);
+  }
+}
+
+// Unsharp mask: the pixels pushed away from their blur by `factor`
+static void sharpen_row(const guint32 *src, const guint32 *blur, guint32 *dst,
+                        gint width, gint factor) {
+  gint x = 0;
+
+#ifdef ENHANCE_HAVE_SSE2
+  if (scale_simd_get() >= SCALE_SIMD_SSE2) {
+    x = sharpen_row_sse2(src, blur, dst, width, factor);
+  }
+#endif
+
+  for (; x < width; x++) {
+    dst[x] = mix_pixel(src[x], blur[x], factor);
+  }
+}
+
+// Tone and saturation, which work on each pixel on its own, src may be dst
+static void enhance_pixels(const struct enhance_lut *lut, const guint32 *src,
+                           gint src_stride, guint32 *dst, gint dst_stride,
+                           gint width, gint height, gboolean opaque) {
+  gint saturation = lut->saturation;
+
+  for (gint y = 0; y < height; y++) {
+    const guint32 *in = src + (gsize)y * src_stride;
+    guint32 *row = dst + (gsize)y * dst_stride;
+    gint x = 0;
+    gint saturated = saturation == 256 ? width : 0;
+
+#ifdef ENHANCE_HAVE_SSE2
+    if (scale_simd_get() >= SCALE_SIMD_AVX2 && ABS(saturation - 256) < 128) {
+      x = enhance_row_avx2((const guint32(*)[256])lut->tone, in, row, width,
+                           saturation - 256, opaque);
+      saturated = MAX(saturated, x);
+    }
+#endif
+
+    tone_row((const guint32(*)[256])lut->tone, in + x, row + x, width - x,
+             opaque);
+    if (saturated < width) {
+      saturate_row(row + saturated, width - saturated, saturation);
+    }
+  }
+}
+
+gboolean enhance_area(const struct enhance_lut *lut, const guint32 *src,
+                      gint src_width, gint src_height, gint src_stride, gint x,
+                      gint y, gint width, gint height, guint32 *dst,
+                      gint dst_stride, gboolean opaque) {
+  gint radius = lut->sharpen_radius;
+  gint n_taps = 2 * radius + 1;
+
+  if (radius == 0) {
+    enhance_pixels(lut, src + (gsize)y * src_stride + x, src_stride, dst,
+                   dst_stride, width, height, opaque);
+    return TRUE;
+  }
+
+  // The area and its margin enhanced, then blurred along rows
+  gint padded_width = width + 2 * radius;
+  gint padded_height = height + 2 * radius;
+  guint32 *padded = g_try_new(guint32, (gsize)padded_width * padded_height);
+  guint32 *rows = g_try_new(guint32, (gsize)width * padded_height);
+  guint32 *blur = g_try_new(guint32, width);
+
+  if (!padded || !rows || !blur) {
+    g_free(padded);
+    g_free(rows);
+    g_free(blur);
+    return FALSE;
+  }
+
+  // Columns of the margin past the image repeat its edges, as rows do
+  gint x1 = MAX(x - radius, 0);
+  gint x2 = MIN(x + width + radius, src_width);
+  gint left = x1 - (x - radius);
+  gint right = left + x2 - x1;
+
+  for (gint j = 0; j < padded_height; j++) {
+    gint src_y = CLAMP(y - radius + j, 0, src_height - 1);
+    guint32 *row = padded + (gsize)j * padded_width;
+
+    enhance_pixels(lut, src + (gsize)src_y * src_stride + x1, src_stride,
+                   row + left, padded_width, x2 - x1, 1, opaque);
+    for (gint i = 0; i < left; i++) {
+      row[i] = row[left];
+    }
+    for (gint i = right; i < padded_width; i++) {
+      row[i] = row[right - 1];
+    }
+
+    resample_blend(row, 1, lut->sharpen_weights, n_taps,
+                   rows + (gsize)j * width, width);
+  }
+
+  // Down the columns, one output row at a time
+  for (gint j = 0; j < height; j++) {
+    resample_blend(rows + (gsize)j * width, width, lut->sharpen_weights,
+                   n_taps, blur, width);
+    sharpen_row(padded + (gsize)(j + radius) * padded_width + radius, blur,
+                dst + (gsize)j * dst_stride, width, 256 + lut->sharpen_amount);
+  }
+
+  g_free(padded);
+  g_free(rows);
+  g_free(blur);
+  return TRUE;
+}
+
+static void enhance_block(guint index, gpointer data) {
+  struct enhance_job *job = data;
+  gint x = (gint)(index % job->columns) * job->block_width;
+  gint y = (gint)(index / job->columns) * ENHANCE_BLOCK_SIZE;
+
+  if (!enhance_area(job->lut, job->src, job->width, job->height,
+                    job->src_stride, x, y,
+                    MIN(job->block_width, job->width - x),
+                    MIN(ENHANCE_BLOCK_SIZE, job->height - y),
+                    job->dst + (gsize)y * job->dst_stride + x, job->dst_stride,
+                    job->opaque)) {
+    g_atomic_int_set(&job->failed, TRUE);
+  }
+}
+
+cairo_surface_t *enhance_surface(cairo_surface_t *src, EnhancePreset preset) {
+  g_return_val_if_fail(preset < ENHANCE_N_PRESETS, NULL);
+
+  cairo_format_t format = cairo_image_surface_get_format(src);
+  if (format != CAIRO_FORMAT_ARGB32 && format != CAIRO_FORMAT_RGB24) {
+    g_warning("source surface format: %d is not supported", format);
+    return NULL;
+  }
+
+  gint width = cairo_image_surface_get_width(src);
+  gint height = cairo_image_surface_get_height(src);
+  cairo_surface_t *dst = cairo_image_surface_create(format, width, height);
+
+  if (cairo_surface_status(dst) != CAIRO_STATUS_SUCCESS) {
+    return dst;
+  }
+
+  struct enhance_lut lut;
+  struct enhance_job job = {
+      .lut = &lut,
+      .opaque = format == CAIRO_FORMAT_RGB24,
+      .width = width,
+      .height = height,
+  };
+  gdouble scale_x, scale_y;
+
+  if (preset == ENHANCE_AUTO) {
+    struct enhance_histogram *histogram = NULL;
+
+    enhance_lut_init(&lut, preset, enhance_histogram_get(&histogram, src, 0));
+    enhance_histogram_free(histogram);
+  } else {
+    enhance_lut_init(&lut, preset, NULL);
+  }
+
+  cairo_surface_flush(src);
+  job.src = (const guint32 *)cairo_image_surface_get_data(src);
+  job.src_stride = cairo_image_surface_get_stride(src) / sizeof(guint32);
+  job.dst = (guint32 *)cairo_image_surface_get_data(dst);
+  job.dst_stride = cairo_image_surface_get_stride(dst) / sizeof(guint32);
+  // Without the mask, whole rows stream through memory faster than blocks
+  job.block_width = lut.sharpen_radius > 0 ? ENHANCE_BLOCK_SIZE : width;
+  job.columns = (width + job.block_width - 1) / job.block_width;
+
+  pool_parallel_for(job.columns *
+                        ((height + ENHANCE_BLOCK_SIZE - 1) / ENHANCE_BLOCK_SIZE),
+                    enhance_block, &job);
+
+  if (job.failed) {
+    g_warning("not enough memory to enhance the image");
+    cairo_surface_destroy(dst);
+    return NULL;
+  }
+
+  cairo_surface_mark_dirty(dst);
+  cairo_surface_get_device_scale(src, &scale_x, &scale_y);
+  cairo_surface_set_device_scale(dst, scale_x, scale_y);
+
+  return dst;
+}
+
+// Device pixels of tile i, clipped to the image
+static struct swappy_box tile_bounds(struct enhance_cache *cache, guint i) {
+  struct swappy_box bounds = {
+      .x = (i % cache->columns) * ENHANCE_TILE_SIZE,
+      .y = (i / cache->columns) * ENHANCE_TILE_SIZE,
+      .width = ENHANCE_TILE_SIZE,
+      .height = ENHANCE_TILE_SIZE,
+  };
+  struct swappy_box image = {0, 0, cache->width, cache->height};
+
+  clip_box(&bounds, &image);
+  return bounds;
+}
+
+static gsize tile_size(struct enhance_tile *tile) {
+  return (gsize)cairo_image_surface_get_stride(tile->surface) *
+         cairo_image_surface_get_height(tile->surface);
+}
+
+static void tile_release(struct enhance_cache *cache,
+                         struct enhance_tile *tile) {
+  if (tile->surface) {
+    cache->size -= tile_size(tile);
+    g_queue_unlink(&cache->lru, &tile->link);
+    cairo_surface_destroy(tile->surface);
+    tile->surface = NULL;
+  }
+  tile->is_valid = FALSE;
+  tile->damage = (struct swappy_box){0};
+}
+
+// Resample the tile, or its damaged part, to device pixels then enhance it
+static void tile_job(guint index, gpointer data) {
+  struct enhance_tile_job *job = data;
+  struct enhance_cache *cache = job->cache;
+  guint i = job->tiles[index];
+  struct enhance_tile *tile = &cache->tiles[i];
+  struct swappy_box bounds = tile_bounds(cache, i);
+  struct swappy_box area = tile->is_valid ? tile->damage : bounds;
+  struct swappy_box image = {0, 0, cache->width, cache->height};
+  gint stride = cairo_image_surface_get_stride(tile->surface) / sizeof(guint32);
+  guint32 *dst = (guint32 *)cairo_image_surface_get_data(tile->surface) +
+                 (gsize)(area.y - bounds.y) * stride + (area.x - bounds.x);
+  gint radius = cache->lut.sharpen_radius;
+
+  // Device pixel (x, y) covers [x, x + 1) / scale in source pixels
+  if (radius == 0) {
+    tile->is_valid =
+        resample_area(job->src, job->src_width, job->src_height,
+                      job->src_stride, area.x / cache->scale,
+                      area.y / cache->scale, cache->scale, dst, area.width,
+                      area.height, stride) &&
+        enhance_area(&cache->lut, dst, area.width, area.height, stride, 0, 0,
+                     area.width, area.height, dst, stride, job->opaque);
+  } else {
+    // The mask reads the margin around the area, resampled along with it
+    struct swappy_box margin = {area.x - radius, area.y - radius,
+                                area.width + 2 * radius,
+                                area.height + 2 * radius};
+    clip_box(&margin, &image);
+
+    guint32 *pixels = g_try_new(guint32, (gsize)margin.width * margin.height);
+
+    tile->is_valid =
+        pixels &&
+        resample_area(job->src, job->src_width, job->src_height,
+                      job->src_stride, margin.x / cache->scale,
+                      margin.y / cache->scale, cache->scale, pixels,
+                      margin.width, margin.height, margin.width) &&
+        enhance_area(&cache->lut, pixels, margin.width, margin.height,
+                     margin.width, area.x - margin.x, area.y - margin.y,
+                     area.width, area.height, dst, stride, job->opaque);
+    g_free(pixels);
+  }
+  tile->damage = (struct swappy_box){0};
+}
+
+static void cache_reset(struct enhance_cache *cache, cairo_surface_t *source,
+                        guint generation, const struct enhance_lut *lut,
+                        gdouble scale) {
+  gint width = (gint)ceil(cairo_image_surface_get_width(source) * scale);
+  gint height = (gint)ceil(cairo_image_surface_get_height(source) * scale);
+  guint n_tiles = cache->columns * cache->rows;
+
+  // Tile surfaces are kept for the same image size, to be made again
+  if (!cache->tiles || cache->width != width || cache->height != height) {
+    for (guint i = 0; i < n_tiles; i++) {
+      tile_release(cache, &cache->tiles[i]);
+    }
+    g_free(cache->tiles);
+
+    cache->width = width;
+    cache->height = height;
+    cache->columns = (width + ENHANCE_TILE_SIZE - 1) / ENHANCE_TILE_SIZE;
+    cache->rows = (height + ENHANCE_TILE_SIZE - 1) / ENHANCE_TILE_SIZE;
+    cache->tiles = g_new0(struct enhance_tile, cache->columns * cache->rows);
+  } else {
+    for (guint i = 0; i < n_tiles; i++) {
+      cache->tiles[i].is_valid = FALSE;
+      cache->tiles[i].damage = (struct swappy_box){0};
+    }
+  }
+
+  if (cache->source) {
+    cairo_surface_destroy(cache->source);
+  }
+  cache->source = cairo_surface_reference(source);
+  cache->generation = generation;
+  cache->lut = *lut;
+  cache->scale = scale;
+}
+
+// Least recently drawn tiles go first, the `keep` drawn last are kept
+static void cache_trim(struct enhance_cache *cache, guint keep) {
+  while (cache->size > ENHANCE_CACHE_BUDGET && cache->lru.length > keep) {
+    tile_release(cache, g_queue_peek_tail(&cache->lru));
+  }
+}
+
+/*
+ * Draw `area` of `source`, in source pixels, enhanced with `lut` and
+ * scaled by `scale`. `cr` is only translated, to put the image origin in
+ * place, it is moved to the nearest device pixel.
+ */
+void enhance_draw(struct enhance_cache **cache, cairo_t *cr,
+                  cairo_surface_t *source, guint generation,
+                  struct swappy_box *area, const struct enhance_lut *lut,
+                  gdouble scale) {
+  struct enhance_cache *current = *cache;
+  gdouble device_x, device_y;
+  cairo_matrix_t matrix;
+
+  cairo_format_t format = cairo_image_surface_get_format(source);
+  if (format != CAIRO_FORMAT_ARGB32 && format != CAIRO_FORMAT_RGB24) {
+    return;
+  }
+
+  if (!current) {
+    current = g_new0(struct enhance_cache, 1);
+    *cache = current;
+  }
+
+  cairo_surface_get_device_scale(cairo_get_target(cr), &device_x, &device_y);
+  scale *= device_x;
+
+  if (current->source != source || current->generation != generation ||
+      current->scale != scale ||
+      memcmp(&current->lut, lut, sizeof(struct enhance_lut)) != 0) {
+    cache_reset(current, source, generation, lut, scale);
+  }
+
+  gint column1 = MAX((gint)floor(area->x * scale), 0) / ENHANCE_TILE_SIZE;
+  gint row1 = MAX((gint)floor(area->y * scale), 0) / ENHANCE_TILE_SIZE;
+  gint column2 =
+      MIN((gint)ceil((area->x + area->width) * scale), current->width) - 1;
+  gint row2 =
+      MIN((gint)ceil((area->y + area->height) * scale), current->height) - 1;
+
+  if (column2 < 0 || row2 < 0) {
+    return;
+  }
+
+  column2 /= ENHANCE_TILE_SIZE;
+  row2 /= ENHANCE_TILE_SIZE;
+
+  if (column1 > column2 || row1 > row2) {
+    return;
+  }
+
+  guint n_tiles = (column2 - column1 + 1) * (row2 - row1 + 1);
+  guint *pending = g_new(guint, n_tiles);
+  guint n_pending = 0;
+
+  // Surfaces are only made for the tiles in view
+  for (gint row = row1; row <= row2; row++) {
+    for (gint column = column1; column <= column2; column++) {
+      guint i = row * current->columns + column;
+      struct enhance_tile *tile = &current->tiles[i];
+
+      if (!tile->surface) {
+        struct swappy_box bounds = tile_bounds(current, i);
+        cairo_surface_t *surface = cairo_image_surface_create(
+            CAIRO_FORMAT_ARGB32, bounds.width, bounds.height);
+
+        if (cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS) {
+          cairo_surface_destroy(surface);
+          continue;
+        }
+        tile->surface = surface;
+        tile->link.data = tile;
+        g_queue_push_head_link(&current->lru, &tile->link);
+        current->size += tile_size(tile);
+      } else {
+        g_queue_unlink(&current->lru, &tile->link);
+        g_queue_push_head_link(&current->lru, &tile->link);
+      }
+
+      if (!tile->is_valid || !is_empty_box(&tile->damage)) {
+        cairo_surface_flush(tile->surface);
+        pending[n_pending++] = i;
+      }
+    }
+  }
+
+  if (n_pending > 0) {
+    cairo_surface_flush(source);
+
+    struct enhance_tile_job job = {
+        .cache = current,
+        .src = (const guint32 *)cairo_image_surface_get_data(source),
+        .src_width = cairo_image_surface_get_width(source),
+        .src_height = cairo_image_surface_get_height(source),
+        .src_stride = cairo_image_surface_get_stride(source) /
+                      sizeof(guint32),
+        .opaque = format == CAIRO_FORMAT_RGB24,
+        .tiles = pending,
+    };
+    pool_parallel_for(n_pending, tile_job, &job);
+
+    for (guint i = 0; i < n_pending; i++) {
+      cairo_surface_mark_dirty(current->tiles[pending[i]].surface);
+    }
+  }
+
+  // Work in device pixels from a whole device pixel, as the zoomed view
+  cairo_get_matrix(cr, &matrix);
+  cairo_save(cr);
+  cairo_identity_matrix(cr);
+  cairo_translate(cr, round(matrix.x0 * device_x) / device_x,
+                  round(matrix.y0 * device_y) / device_y);
+  cairo_scale(cr, 1 / device_x, 1 / device_y);
+
+  // Tiles share their edges exactly, antialiasing would show the seams
+  cairo_set_antialias(cr, CAIRO_ANTIALIAS_NONE);
+
+  for (gint row = row1; row <= row2; row++) {
+    for (gint column = column1; column <= column2; column++) {
+      guint i = row * current->columns + column;
+      struct enhance_tile *tile = &current->tiles[i];
+      struct swappy_box bounds = tile_bounds(current, i);
+
+      if (!tile->is_valid) {
+        continue;
+      }
+
+      cairo_set_source_surface(cr, tile->surface, bounds.x, bounds.y);
+      cairo_pattern_set_filter(cairo_get_source(cr), CAIRO_FILTER_NEAREST);
+      cairo_rectangle(cr, bounds.x, bounds.y, bounds.width, bounds.height);
+      cairo_fill(cr);
+    }
+  }
+  cairo_restore(cr);
+
+  cache_trim(current, n_tiles);
+
+  current->hits += n_tiles - n_pending;
+  current->misses += n_pending;
+  g_debug("enhance cache at %.3f: %u hits, %u misses, %u tiles "
+          "(%" G_GSIZE_FORMAT " KiB), %u hits and %u misses so far",
+          scale, n_tiles - n_pending, n_pending, current->lru.length,
+          current->size / 1024, current->hits, current->misses);
+
+  g_free(pending);
+}
+
+void enhance_cache_damage(struct enhance_cache *cache, struct swappy_box *area,
+                          guint generation) {
+  // Changes on top of content the tiles were not made from redo them all
+  if (!cache || !cache->tiles || cache->generation + 1 != generation) {
+    return;
+  }
+
+  cache->generation = generation;
+
+  // Device pixels whose area or mask reaches the damage, one more for
+  // rounding
+  struct swappy_box image = {0, 0, cache->width, cache->height};
+  struct swappy_box damage;
+  gint margin = 1 + cache->lut.sharpen_radius;
+  gint x1 = (gint)floor(area->x * cache->scale) - margin;
+  gint y1 = (gint)floor(area->y * cache->scale) - margin;
+  gint x2 = (gint)ceil((area->x + area->width) * cache->scale) + margin;
+  gint y2 = (gint)ceil((area->y + area->height) * cache->scale) + margin;
+
+  damage = (struct swappy_box){x1, y1, x2 - x1, y2 - y1};
+  if (!clip_box(&damage, &image)) {
+    return;
+  }
+
+  for (gint row = damage.y / ENHANCE_TILE_SIZE;
+       row <= (damage.y + damage.height - 1) / ENHANCE_TILE_SIZE; row++) {
+    for (gint column = damage.x / ENHANCE_TILE_SIZE;
+         column <= (damage.x + damage.width - 1) / ENHANCE_TILE_SIZE;
+         column++) {
+      guint i = row * cache->columns + column;
+      struct enhance_tile *tile = &cache->tiles[i];
+      struct swappy_box bounds = tile_bounds(cache, i);
+      struct swappy_box part = damage;
+
+      if (tile->is_valid && clip_box(&part, &bounds)) {
+        union_box(&tile->damage, &part);
+      }
+    }
+  }
+}
+
+void enhance_cache_free(struct enhance_cache *cache) {
+  if (!cache) {
+    return;
+  }
+
+  for (gint i = 0; i < cache->columns * cache->rows; i++) {
+    tile_release(cache, &cache->tiles[i]);
+  }
+  if (cache->source) {
+    cairo_surface_destroy(cache->source);
+  }
+  g_free(cache->tiles);
+  g_free(cache);
+}
+
+const char *enhance_preset_name(EnhancePreset preset) {
+  if (preset >= ENHANCE_N_PRESETS) {
+    return "unknown";
+  }
+
+  return presets[preset].name;
+}
@@ -1,9 +1,13 @@
 #include "paint.h"
 
 #include <glib.h>
+#include <math.h>
 #include <stdio.h>
 
+#include "box.h"
+#include "checkpoint.h"
 #include "gtk/gtk.h"
+#include "render.h"
 #include "util.h"
 
 static void cursor_move_backward(struct swappy_paint_text *text) {
@@ -18,6 +22,193 @@ static void cursor_move_forward(struct swappy_paint_text *text) {
   }
 }
 
+static void shape_get_bounds(struct swappy_paint_shape *shape,
+                             struct swappy_box *box) {
+  double dx = fabs(shape->from.x - shape->to.x);
+  double dy = fabs(shape->from.y - shape->to.y);
+  double stroke = shape->w / 2 + 1;
+
+  switch (shape->type) {
+    case SWAPPY_PAINT_MODE_RECTANGLE:
+    case SWAPPY_PAINT_MODE_ELLIPSE:
+      if (shape->should_center_at_from) {
+        box_from_extents(box, shape->from.x - dx, shape->from.y - dy,
+                         shape->from.x + dx, shape->from.y + dy, stroke);
+      } else {
+        box_from_extents(box, shape->from.x, shape->from.y, shape->to.x,
+                         shape->to.y, stroke);
+      }
+      break;
+    case SWAPPY_PAINT_MODE_ARROW:
+      // Arrowhead has a radius of 20 scaled by w / 4, see render_shape_arrow
+      box_from_extents(box, shape->from.x, shape->from.y, shape->to.x,
+                       shape->to.y, shape->w * 5 + 1);
+      break;
+    default:
+      box_from_extents(box, shape->from.x, shape->from.y, shape->to.x,
+                       shape->to.y, stroke);
+      break;
+  }
+}
+
+static void brush_get_bounds(struct swappy_paint_brush *brush, double padding,
+                             struct swappy_box *box) {
+  double x1 = G_MAXDOUBLE, y1 = G_MAXDOUBLE;
+  double x2 = -G_MAXDOUBLE, y2 = -G_MAXDOUBLE;
+
+  for (guint i = 0; i < brush->n_points; i++) {
+    struct swappy_stroke_point *point = &brush->points[i];
+    x1 = fmin(x1, point->x);
+    y1 = fmin(y1, point->y);
+    x2 = fmax(x2, point->x);
+    y2 = fmax(y2, point->y);
+  }
+
+  if (x1 > x2) {
+    return;
+  }
+
+  box_from_extents(box, x1, y1, x2, y2, padding);
+}
+
+static void brush_append_point(struct swappy_paint_brush *brush, double x,
+                               double y) {
+  if (brush->n_points == brush->n_allocated) {
+    brush->n_allocated = MAX(brush->n_allocated * 2, BRUSH_INITIAL_POINTS);
+    brush->points = g_renew(struct swappy_stroke_point, brush->points,
+                            brush->n_allocated);
+  }
+
+  brush->points[brush->n_points].x = (gfloat)x;
+  brush->points[brush->n_points].y = (gfloat)y;
+  brush->n_points++;
+}
+
+static double segment_distance(struct swappy_stroke_point *p,
+                               struct swappy_stroke_point *a,
+                               struct swappy_stroke_point *b) {
+  double dx = b->x - a->x;
+  double dy = b->y - a->y;
+  double length = dx * dx + dy * dy;
+
+  if (length == 0) {
+    return hypot(p->x - a->x, p->y - a->y);
+  }
+
+  double t = CLAMP(((p->x - a->x) * dx + (p->y - a->y) * dy) / length, 0, 1);
+
+  return hypot(p->x - (a->x + t * dx), p->y - (a->y + t * dy));
+}
+
+/*
+ * Ramer-Douglas-Peucker simplification, points closer than the tolerance to
+ * the simplified stroke are dropped. The tolerance is well below a pixel so
+ * the stroke renders the same.
+ */
+static void brush_simplify(struct swappy_paint_brush *brush) {
+  guint n = brush->n_points;
+
+  if (n < 3) {
+    return;
+  }
+
+  struct swappy_stroke_point *points = brush->points;
+  guint8 *keep = g_new0(guint8, n);
+  guint *stack = g_new(guint, 2 * n);
+  guint top = 0;
+
+  keep[0] = keep[n - 1] = 1;
+  stack[top++] = 0;
+  stack[top++] = n - 1;
+
+  while (top > 0) {
+    guint last = stack[--top];
+    guint first = stack[--top];
+    double max_distance = 0;
+    guint index = first;
+
+    for (guint i = first + 1; i < last; i++) {
+      double distance = segment_distance(&points[i], &points[first],
+                                         &points[last]);
+      if (distance > max_distance) {
+        max_distance = distance;
+        index = i;
+      }
+    }
+
+    if (max_distance > BRUSH_SIMPLIFY_TOLERANCE) {
+      keep[index] = 1;
+      stack[top++] = first;
+      stack[top++] = index;
+      stack[top++] = index;
+      stack[top++] = last;
+    }
+  }
+
+  guint count = 0;
+  for (guint i = 0; i < n; i++) {
+    if (keep[i]) {
+      points[count++] = points[i];
+    }
+  }
+
+  g_free(stack);
+  g_free(keep);
+
+  brush->n_points = count;
+  brush->n_allocated = count;
+  brush->points = g_renew(struct swappy_stroke_point, points, count);
+
+  g_debug("brush simplified from %u to %u points", n, count);
+}
+
+void paint_get_bounds(struct swappy_state *state, struct swappy_paint *paint,
+                      struct swappy_box *box) {
+  box->x = 0;
+  box->y = 0;
+  box->width = 0;
+  box->height = 0;
+
+  if (!paint || !paint->can_draw) {
+    return;
+  }
+
+  switch (paint->type) {
+    case SWAPPY_PAINT_MODE_BLUR:
+      box_from_extents(box, paint->content.blur.from.x,
+                       paint->content.blur.from.y, paint->content.blur.to.x,
+                       paint->content.blur.to.y, 1);
+      break;
+    case SWAPPY_PAINT_MODE_BRUSH:
+      // Single points are drawn as a w x w square starting at the point
+      brush_get_bounds(&paint->content.brush, paint->content.brush.w + 1, box);
+      break;
+    case SWAPPY_PAINT_MODE_HIGHLIGHTER:
+      // Three times wider than the brush with square caps
+      brush_get_bounds(&paint->content.brush,
+                       paint->content.brush.w * 3 * G_SQRT2 / 2 + 1, box);
+      break;
+    case SWAPPY_PAINT_MODE_RECTANGLE:
+    case SWAPPY_PAINT_MODE_ELLIPSE:
+    case SWAPPY_PAINT_MODE_ARROW:
+    case SWAPPY_PAINT_MODE_LINE:
+      shape_get_bounds(&paint->content.shape, box);
+      break;
+    case SWAPPY_PAINT_MODE_TEXT:
+      // Text is clipped to its box, the edit frame is stroked 5px wide
+      box_from_extents(box, paint->content.text.from.x,
+                       paint->content.text.from.y, paint->content.text.to.x,
+                       paint->content.text.to.y, 3);
+      break;
+    case SWAPPY_PAINT_MODE_CROP:
+      box->width = gdk_pixbuf_get_width(state->original_image);
+      box->height = gdk_pixbuf_get_height(state->original_image);
+      break;
+    default:
+      break;
+  }
+}
+
 void paint_free(gpointer data) {
   struct swappy_paint *paint = (struct swappy_paint *)data;
 
@@ -33,11 +224,19 @@ void paint_free(gpointer data) {
       break;
     case SWAPPY_PAINT_MODE_BRUSH:
     case SWAPPY_PAINT_MODE_HIGHLIGHTER:
-      g_list_free_full(paint->content.brush.points, g_free);
+      g_free(paint->content.brush.points);
       break;
     case SWAPPY_PAINT_MODE_TEXT:
       g_free(paint->content.text.text);
       g_free(paint->content.text.font);
+      if (paint->content.text.layout) {
+        g_object_unref(paint->content.text.layout);
+      }
+      if (paint->content.text.font_desc) {
+        pango_font_description_free(paint->content.text.font_desc);
+      }
+      g_free(paint->content.text.layout_text);
+      g_free(paint->content.text.layout_font);
       break;
     default:
       break;
@@ -57,12 +256,12 @@ void paint_free_all(struct swappy_state *state) {
   paint_free_list(&state->redo_paints);
   paint_free(state->temp_paint);
   state->temp_paint = NULL;
+  checkpoint_free_all(state);
 }
 
 void paint_add_temporary(struct swappy_state *state, double x, double y,
                          enum swappy_paint_type type) {
   struct swappy_paint *paint = g_new(struct swappy_paint, 1);
-  struct swappy_point *point;
 
   double r = state->settings.r;
   double g = state->settings.g;
@@ -104,12 +303,11 @@ void paint_add_temporary(struct swappy_state *state, double x, double y,
       paint->content.brush.b = b;
       paint->content.brush.a = a;
       paint->content.brush.w = w;
+      paint->content.brush.points = NULL;
+      paint->content.brush.n_points = 0;
+      paint->content.brush.n_allocated = 0;
 
-      point = g_new(struct swappy_point, 1);
-      point->x = x;
-      point->y = y;
-
-      paint->content.brush.points = g_list_prepend(NULL, point);
+      brush_append_point(&paint->content.brush, x, y);
       break;
     case SWAPPY_PAINT_MODE_RECTANGLE:
     case SWAPPY_PAINT_MODE_ELLIPSE:
@@ -146,6 +344,10 @@ void paint_add_temporary(struct swappy_state *state, double x, double y,
       paint->content.text.mode = SWAPPY_TEXT_MODE_EDIT;
       paint->content.text.text = g_new(gchar, 1);
       paint->content.text.text[0] = '\0';
+      paint->content.text.layout = NULL;
+      paint->content.text.font_desc = NULL;
+      paint->content.text.layout_text = NULL;
+      paint->content.text.layout_font = NULL;
       break;
 
     default:
@@ -159,8 +361,6 @@ void paint_add_temporary(struct swappy_state *state, double x, double y,
 void paint_update_temporary_shape(struct swappy_state *state, double x,
                                   double y, gboolean is_control_pressed) {
   struct swappy_paint *paint = state->temp_paint;
-  struct swappy_point *point;
-  GList *points;
 
   if (!paint) {
     return;
@@ -174,12 +374,7 @@ void paint_update_temporary_shape(struct swappy_state *state, double x,
       break;
     case SWAPPY_PAINT_MODE_BRUSH:
     case SWAPPY_PAINT_MODE_HIGHLIGHTER:
-      points = paint->content.brush.points;
-      point = g_new(struct swappy_point, 1);
-      point->x = x;
-      point->y = y;
-
-      paint->content.brush.points = g_list_prepend(points, point);
+      brush_append_point(&paint->content.brush, x, y);
       break;
     case SWAPPY_PAINT_MODE_RECTANGLE:
     case SWAPPY_PAINT_MODE_ELLIPSE:
@@ -294,6 +489,7 @@ void paint_update_temporary_text_clip(struct swappy_state *state, gdouble x,
 }
 
 void paint_commit_temporary(struct swappy_state *state) {
+  static guint next_id = 0;
   struct swappy_paint *paint = state->temp_paint;
 
   if (!paint) {
@@ -307,6 +503,10 @@ void paint_commit_temporary(struct swappy_state *state) {
       }
       paint->content.text.mode = SWAPPY_TEXT_MODE_DONE;
       break;
+    case SWAPPY_PAINT_MODE_BRUSH:
+    case SWAPPY_PAINT_MODE_HIGHLIGHTER:
+      brush_simplify(&paint->content.brush);
+      break;
     default:
       break;
   }
@@ -315,7 +515,10 @@ void paint_commit_temporary(struct swappy_state *state) {
     paint_free(paint);
   } else {
     paint->is_committed = true;
+    paint->id = ++next_id;
+    state->checkpoint_pending_paints++;
     state->paints = g_list_prepend(state->paints, paint);
+    render_invalidate_paint(state, paint);
   }
 
   gtk_im_context_focus_out(state->ui->im_context);
@@ -8,7 +8,10 @@
 #include <string.h>
 #include <unistd.h>
 
+#include "checkpoint.h"
 #include "enhance.h"
+#include "raster.h"
+#include "zoom.h"
 
 static void write_file(GdkPixbuf *pixbuf, char *path);
 
@@ -411,6 +414,14 @@ void pixbuf_scale_surface_from_widget(struct swappy_state *state,
     goto finish;
   }
 
+  cairo_surface_t *committed_surface =
+      cairo_image_surface_create(format, image_width, image_height);
+
+  if (!committed_surface) {
+    g_error("unable to create committed surface");
+    goto finish;
+  }
+
   g_info("size of area to render: %ux%u", alloc->width, alloc->height);
 
 finish:
@@ -426,6 +437,25 @@ finish:
   }
   state->rendering_surface = rendering_surface;
 
+  if (state->committed_surface) {
+    cairo_surface_destroy(state->committed_surface);
+    state->committed_surface = NULL;
+  }
+  state->committed_surface = committed_surface;
+  raster_init(state, image_width, image_height);
+
+  if (state->stroke_surface) {
+    cairo_surface_destroy(state->stroke_surface);
+    state->stroke_surface = NULL;
+  }
+  state->stroke_paint = NULL;
+  checkpoint_free_all(state);
+  state->content_generation++;
+
+  // Also stops the tiles queued ahead from upscaling the previous surface
+  struct swappy_box image_box = {0, 0, image_width, image_height};
+  zoom_cache_damage(state->zoom_cache, &image_box, state->content_generation);
+
   g_free(alloc);
 }
 
@@ -0,0 +1,458 @@
+#include "pixelate.h"
+
+#include <stdbool.h>
+#include <string.h>
+
+#include "scale2x.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define PIXELATE_HAVE_SSE2 1
+#include <immintrin.h>
+#endif
+
+struct pixelate_region {
+  gint origin_x; /* Region in source pixels */
+  gint origin_y;
+  gint width;
+  gint height;
+  gint x1; /* Part of the region inside of the source */
+  gint y1;
+  gint x2;
+  gint y2;
+  gint anchor_x; /* Block grid origin */
+  gint anchor_y;
+  gint block;
+};
+
+static gint floor_div(gint a, gint b) {
+  return a >= 0 ? a / b : -((-a + b - 1) / b);
+}
+
+static bool is_supported_format(cairo_format_t format) {
+  switch (format) {
+    case CAIRO_FORMAT_RGB24:
+    case CAIRO_FORMAT_ARGB32:
+      return true;
+    case CAIRO_FORMAT_A1:
+    case CAIRO_FORMAT_A8:
+    default:
+      g_warning("source surface format: %d is not supported", format);
+      return false;
+  }
+}
+
+static bool region_init(struct pixelate_region *region,
+                        cairo_surface_t *surface, double x, double y,
+                        double width, double height, double anchor_x,
+                        double anchor_y) {
+  gdouble scale_x, scale_y;
+
+  cairo_surface_get_device_scale(surface, &scale_x, &scale_y);
+
+  region->origin_x = (gint)(x * scale_x);
+  region->origin_y = (gint)(y * scale_y);
+  region->width = (gint)(width * scale_x);
+  region->height = (gint)(height * scale_y);
+  region->anchor_x = (gint)(anchor_x * scale_x);
+  region->anchor_y = (gint)(anchor_y * scale_y);
+  region->block = MAX((gint)(PIXELATE_BLOCK_SIZE * scale_x), 4);
+
+  gint src_width = cairo_image_surface_get_width(surface);
+  gint src_height = cairo_image_surface_get_height(surface);
+
+  region->x1 = CLAMP(region->origin_x, 0, src_width);
+  region->y1 = CLAMP(region->origin_y, 0, src_height);
+  region->x2 = CLAMP(region->origin_x + region->width, 0, src_width);
+  region->y2 = CLAMP(region->origin_y + region->height, 0, src_height);
+
+  return region->width > 0 && region->height > 0;
+}
+
+static bool cache_lookup(struct pixelate_cache *cache, gint column, gint row,
+                         guint32 *color) {
+  gint index = (row - cache->row0) * cache->columns + (column - cache->column0);
+
+  if (!cache->is_valid[index]) {
+    cache->misses++;
+    return false;
+  }
+
+  *color = cache->colors[index];
+  cache->hits++;
+  return true;
+}
+
+static void cache_store(struct pixelate_cache *cache, gint column, gint row,
+                        guint32 color) {
+  gint index = (row - cache->row0) * cache->columns + (column - cache->column0);
+
+  cache->colors[index] = color;
+  cache->is_valid[index] = 1;
+}
+
+/* Rows added to the 16-bit channel sums before they can overflow */
+#define PIXELATE_ROWS_PER_PASS (G_MAXUINT16 / 255)
+
+#ifdef PIXELATE_HAVE_SSE2
+/* Same as add_row on four pixels at a time, returns the pixels done */
+__attribute__((target("sse2"))) static gint add_row_sse2(const guint32 *src,
+                                                         guint32 *sums,
+                                                         gint width) {
+  const __m128i mask = _mm_set1_epi32(0x00ff00ff);
+  gint x = 0;
+
+  for (; x + 4 <= width; x += 4) {
+    __m128i p = _mm_loadu_si128((const __m128i *)(src + x));
+    __m128i rb = _mm_and_si128(p, mask);
+    __m128i ag = _mm_and_si128(_mm_srli_epi32(p, 8), mask);
+    __m128i *lo = (__m128i *)(sums + 2 * x);
+    __m128i *hi = lo + 1;
+
+    _mm_storeu_si128(lo, _mm_add_epi32(_mm_loadu_si128(lo),
+                                       _mm_unpacklo_epi32(rb, ag)));
+    _mm_storeu_si128(hi, _mm_add_epi32(_mm_loadu_si128(hi),
+                                       _mm_unpackhi_epi32(rb, ag)));
+  }
+
+  return x;
+}
+#endif
+
+/*
+ * Add `width` pixels to the per-column sums, two channels per 32-bit sum
+ * as in the resampler: red and blue, then alpha and green.
+ */
+static void add_row(const guint32 *src, guint32 *sums, gint width) {
+  gint x = 0;
+
+#ifdef PIXELATE_HAVE_SSE2
+  if (scale_simd_get() >= SCALE_SIMD_SSE2) {
+    x = add_row_sse2(src, sums, width);
+  }
+#endif
+
+  for (; x < width; x++) {
+    sums[2 * x] += src[x] & 0x00ff00ff;
+    sums[2 * x + 1] += (src[x] >> 8) & 0x00ff00ff;
+  }
+}
+
+/*
+ * Fill `region` of `dst` with the average color of each block.
+ *
+ * A row of blocks is reduced to a summed-area table one block high: the
+ * channels are summed down each column, in 16 bits for up to
+ * PIXELATE_ROWS_PER_PASS rows at a time, then accumulated along the row.
+ * The sum of a block is the difference of two entries, whatever its width.
+ * Only the columns between the first and last blocks not found in `cache`
+ * are read. Sums wrap around modulo 2^32, the difference of two entries
+ * is exact since a block holds far less than 2^24 pixels.
+ */
+static void pixelate(cairo_surface_t *surface, guint8 *dst_data,
+                     gint dst_stride, struct pixelate_region *region,
+                     struct pixelate_cache *cache) {
+  gint block = region->block;
+  gint ax = region->anchor_x;
+  gint ay = region->anchor_y;
+
+  if (region->x1 >= region->x2 || region->y1 >= region->y2) {
+    return;
+  }
+
+  cairo_surface_flush(surface);
+
+  guint8 *src_data = cairo_image_surface_get_data(surface);
+  gint src_stride = cairo_image_surface_get_stride(surface);
+
+  gint column1 = floor_div(region->x1 - ax, block);
+  gint column2 = floor_div(region->x2 - 1 - ax, block);
+  gint n_blocks = column2 - column1 + 1;
+  gint width = region->x2 - region->x1;
+  guint32 *columns = g_new(guint32, 2 * width);
+  guint32 *table = g_new(guint32, 4 * (width + 1));
+  guint32 *colors = g_new(guint32, n_blocks);
+  guint8 *is_needed = g_new(guint8, n_blocks);
+
+  for (gint row = floor_div(region->y1 - ay, block);; row++) {
+    gint by1 = MAX(ay + row * block, region->y1);
+    gint by2 = MIN(ay + (row + 1) * block, region->y2);
+    gint first = n_blocks;
+    gint last = -1;
+
+    if (by1 >= region->y2) {
+      break;
+    }
+
+    for (gint b = 0; b < n_blocks; b++) {
+      gint bx1 = MAX(ax + (column1 + b) * block, region->x1);
+      gint bx2 = MIN(ax + (column1 + b + 1) * block, region->x2);
+      bool is_full = bx2 - bx1 == block && by2 - by1 == block;
+
+      is_needed[b] =
+          !(is_full && cache && cache_lookup(cache, column1 + b, row, &colors[b]));
+      if (is_needed[b]) {
+        first = MIN(first, b);
+        last = b;
+      }
+    }
+
+    // Entry i of the table sums the columns from x1 to x1 + i - 1
+    gint x1 = region->x1;
+
+    if (first <= last) {
+      x1 = MAX(ax + (column1 + first) * block, region->x1);
+      gint x2 = MIN(ax + (column1 + last + 1) * block, region->x2);
+
+      memset(table, 0, sizeof(guint32) * 4 * (x2 - x1 + 1));
+
+      for (gint y = by1; y < by2; y += PIXELATE_ROWS_PER_PASS) {
+        memset(columns, 0, sizeof(guint32) * 2 * (x2 - x1));
+        for (gint i = y; i < MIN(y + PIXELATE_ROWS_PER_PASS, by2); i++) {
+          add_row((guint32 *)(src_data + i * src_stride) + x1, columns,
+                  x2 - x1);
+        }
+
+        for (gint x = 0; x < x2 - x1; x++) {
+          guint32 *sum = &table[4 * (x + 1)];
+          guint32 rb = columns[2 * x];
+          guint32 ag = columns[2 * x + 1];
+
+          sum[0] += rb & 0xffff;
+          sum[1] += ag & 0xffff;
+          sum[2] += rb >> 16;
+          sum[3] += ag >> 16;
+        }
+      }
+
+      for (gint i = 4; i < 4 * (x2 - x1 + 1); i++) {
+        table[i] += table[i - 4];
+      }
+    }
+
+    for (gint b = 0; b < n_blocks; b++) {
+      gint bx1 = MAX(ax + (column1 + b) * block, region->x1);
+      gint bx2 = MIN(ax + (column1 + b + 1) * block, region->x2);
+
+      if (is_needed[b]) {
+        const guint32 *left = table + 4 * (bx1 - x1);
+        const guint32 *right = table + 4 * (bx2 - x1);
+        guint32 count = (bx2 - bx1) * (by2 - by1);
+
+        colors[b] = 0;
+        for (gint c = 0; c < 4; c++) {
+          colors[b] |= ((right[c] - left[c]) / count) << (8 * c);
+        }
+        if (cache && bx2 - bx1 == block && by2 - by1 == block) {
+          cache_store(cache, column1 + b, row, colors[b]);
+        }
+      }
+
+      for (gint y = by1; y < by2; y++) {
+        guint32 *d =
+            (guint32 *)(dst_data + (y - region->origin_y) * dst_stride);
+        for (gint x = bx1; x < bx2; x++) {
+          d[x - region->origin_x] = colors[b];
+        }
+      }
+    }
+  }
+
+  g_free(is_needed);
+  g_free(colors);
+  g_free(table);
+  g_free(columns);
+}
+
+/*
+ * Pixelate a region of surface - non-reversible privacy redaction.
+ * Divides the region into blocks and fills each with the average color.
+ * Only the region is read and the result is a region sized surface, pixels
+ * of the region outside of the source are left transparent.
+ */
+cairo_surface_t *pixelate_region(cairo_surface_t *surface, double x, double y,
+                                 double width, double height, double anchor_x,
+                                 double anchor_y) {
+  struct pixelate_region region;
+
+  if (cairo_surface_status(surface)) {
+    return NULL;
+  }
+
+  cairo_format_t format = cairo_image_surface_get_format(surface);
+
+  if (!is_supported_format(format) ||
+      !region_init(&region, surface, x, y, width, height, anchor_x,
+                   anchor_y)) {
+    return NULL;
+  }
+
+  cairo_surface_t *result =
+      cairo_image_surface_create(format, region.width, region.height);
+
+  if (cairo_surface_status(result)) {
+    cairo_surface_destroy(result);
+    return NULL;
+  }
+
+  gdouble scale_x, scale_y;
+  cairo_surface_get_device_scale(surface, &scale_x, &scale_y);
+  cairo_surface_set_device_scale(result, scale_x, scale_y);
+
+  cairo_surface_flush(result);
+  pixelate(surface, cairo_image_surface_get_data(result),
+           cairo_image_surface_get_stride(result), &region, NULL);
+  cairo_surface_mark_dirty(result);
+
+  return result;
+}
+
+static struct pixelate_cache *cache_new(cairo_surface_t *surface,
+                                        guint generation,
+                                        struct pixelate_region *region) {
+  struct pixelate_cache *cache = g_new0(struct pixelate_cache, 1);
+
+  cache->source = surface;
+  cache->generation = generation;
+  cache->anchor_x = region->anchor_x;
+  cache->anchor_y = region->anchor_y;
+  cache->block = region->block;
+
+  return cache;
+}
+
+/*
+ * Grow the block grid of `cache` to cover the blocks of `region`, keeping
+ * the blocks already averaged. The grid follows the rectangle being
+ * dragged, not the source, so it stays the size of the largest rectangle.
+ */
+static void cache_cover(struct pixelate_cache *cache,
+                        struct pixelate_region *region) {
+  if (region->x1 >= region->x2 || region->y1 >= region->y2) {
+    return;
+  }
+
+  gint column1 = floor_div(region->x1 - cache->anchor_x, cache->block);
+  gint row1 = floor_div(region->y1 - cache->anchor_y, cache->block);
+  gint column2 = floor_div(region->x2 - 1 - cache->anchor_x, cache->block) + 1;
+  gint row2 = floor_div(region->y2 - 1 - cache->anchor_y, cache->block) + 1;
+
+  if (cache->columns > 0 && cache->rows > 0) {
+    if (column1 >= cache->column0 && row1 >= cache->row0 &&
+        column2 <= cache->column0 + cache->columns &&
+        row2 <= cache->row0 + cache->rows) {
+      return;
+    }
+
+    column1 = MIN(column1, cache->column0);
+    row1 = MIN(row1, cache->row0);
+    column2 = MAX(column2, cache->column0 + cache->columns);
+    row2 = MAX(row2, cache->row0 + cache->rows);
+  }
+
+  gint columns = column2 - column1;
+  gint rows = row2 - row1;
+  guint32 *colors = g_new(guint32, columns * rows);
+  guint8 *is_valid = g_new0(guint8, columns * rows);
+
+  for (gint row = 0; row < cache->rows; row++) {
+    gint index = (cache->row0 + row - row1) * columns + cache->column0 - column1;
+
+    memcpy(&colors[index], &cache->colors[row * cache->columns],
+           sizeof(guint32) * cache->columns);
+    memcpy(&is_valid[index], &cache->is_valid[row * cache->columns],
+           cache->columns);
+  }
+
+  g_free(cache->colors);
+  g_free(cache->is_valid);
+  cache->colors = colors;
+  cache->is_valid = is_valid;
+  cache->column0 = column1;
+  cache->row0 = row1;
+  cache->columns = columns;
+  cache->rows = rows;
+}
+
+/*
+ * Same as pixelate_region but block averages are kept in `cache` and reused
+ * as long as the source, its generation and the block grid are unchanged.
+ * The returned surface uses memory owned by the cache, it must be destroyed
+ * before the next call.
+ */
+cairo_surface_t *pixelate_region_cached(struct pixelate_cache **cache,
+                                        cairo_surface_t *surface,
+                                        guint generation, double x, double y,
+                                        double width, double height,
+                                        double anchor_x, double anchor_y) {
+  struct pixelate_region region;
+
+  if (cairo_surface_status(surface)) {
+    return NULL;
+  }
+
+  cairo_format_t format = cairo_image_surface_get_format(surface);
+
+  if (!is_supported_format(format) ||
+      !region_init(&region, surface, x, y, width, height, anchor_x,
+                   anchor_y)) {
+    return NULL;
+  }
+
+  struct pixelate_cache *current = *cache;
+
+  if (current &&
+      (current->source != surface || current->generation != generation ||
+       current->anchor_x != region.anchor_x ||
+       current->anchor_y != region.anchor_y ||
+       current->block != region.block)) {
+    g_debug("pixelate cache reset after %u hits, %u misses", current->hits,
+            current->misses);
+    pixelate_cache_free(current);
+    current = NULL;
+  }
+
+  if (!current) {
+    current = cache_new(surface, generation, &region);
+    *cache = current;
+  }
+
+  cache_cover(current, &region);
+
+  gint stride = cairo_format_stride_for_width(format, region.width);
+  gsize size = (gsize)stride * region.height;
+
+  if (current->buffer_size < size) {
+    g_free(current->buffer);
+    current->buffer = g_malloc(size);
+    current->buffer_size = size;
+  }
+
+  // Pixels outside of the source stay transparent
+  if (region.x1 != region.origin_x || region.y1 != region.origin_y ||
+      region.x2 != region.origin_x + region.width ||
+      region.y2 != region.origin_y + region.height) {
+    memset(current->buffer, 0, size);
+  }
+
+  pixelate(surface, current->buffer, stride, &region, current);
+
+  cairo_surface_t *result = cairo_image_surface_create_for_data(
+      current->buffer, format, region.width, region.height, stride);
+
+  gdouble scale_x, scale_y;
+  cairo_surface_get_device_scale(surface, &scale_x, &scale_y);
+  cairo_surface_set_device_scale(result, scale_x, scale_y);
+
+  return result;
+}
+
+void pixelate_cache_free(struct pixelate_cache *cache) {
+  if (!cache) {
+    return;
+  }
+
+  g_free(cache->colors);
+  g_free(cache->is_valid);
+  g_free(cache->buffer);
+  g_free(cache);
+}
@@ -0,0 +1,139 @@
+#include "pool.h"
+
+/*
+ * Worker pool used to split rendering work into independent jobs.
+ *
+ * The calling thread takes part in the work, so a batch always completes
+ * even when every worker is busy. Batches started from a worker run inline.
+ */
+
+struct pool_batch {
+  pool_job_func func;
+  gpointer data;
+  guint n_jobs;
+  gint next;
+  gint pending;
+  GMutex mutex;
+  GCond cond;
+};
+
+static GThreadPool *pool = NULL;
+static guint pool_n_threads = 1;
+static GPrivate pool_in_worker;
+
+static void run_jobs(struct pool_batch *batch) {
+  guint index;
+
+  while ((index = (guint)g_atomic_int_add(&batch->next, 1)) < batch->n_jobs) {
+    batch->func(index, batch->data);
+  }
+}
+
+static void worker_func(gpointer task, gpointer user_data) {
+  struct pool_batch *batch = task;
+
+  g_private_set(&pool_in_worker, GINT_TO_POINTER(TRUE));
+  run_jobs(batch);
+
+  // The batch lives on the caller stack, do not touch it after signaling
+  g_mutex_lock(&batch->mutex);
+  batch->pending--;
+  g_cond_signal(&batch->cond);
+  g_mutex_unlock(&batch->mutex);
+}
+
+void pool_init(gint n_threads) {
+  GError *error = NULL;
+
+  if (pool) {
+    return;
+  }
+
+  if (n_threads <= 0) {
+    n_threads = (gint)g_get_num_processors();
+  }
+
+  pool_n_threads = (guint)n_threads;
+
+  // The calling thread is one of the workers
+  if (n_threads <= 1) {
+    g_info("worker pool disabled, rendering on a single thread");
+    return;
+  }
+
+  pool = g_thread_pool_new(worker_func, NULL, n_threads - 1, FALSE, &error);
+
+  if (error != NULL) {
+    g_warning("unable to create worker pool: %s", error->message);
+    g_error_free(error);
+    pool = NULL;
+    pool_n_threads = 1;
+    return;
+  }
+
+  g_info("worker pool created with %d threads", n_threads);
+}
+
+void pool_finish(void) {
+  if (pool) {
+    g_thread_pool_free(pool, FALSE, TRUE);
+    pool = NULL;
+  }
+  pool_n_threads = 1;
+}
+
+guint pool_get_n_threads(void) { return pool_n_threads; }
+
+void pool_parallel_for(guint n_jobs, pool_job_func func, gpointer data) {
+  struct pool_batch batch = {
+      .func = func,
+      .data = data,
+      .n_jobs = n_jobs,
+      .next = 0,
+      .pending = 0,
+  };
+  GError *error = NULL;
+
+  if (n_jobs == 0) {
+    return;
+  }
+
+  if (!pool || n_jobs == 1 || g_private_get(&pool_in_worker)) {
+    for (guint i = 0; i < n_jobs; i++) {
+      func(i, data);
+    }
+    return;
+  }
+
+  g_mutex_init(&batch.mutex);
+  g_cond_init(&batch.cond);
+
+  guint n_tasks = MIN(n_jobs, pool_n_threads) - 1;
+
+  for (guint i = 0; i < n_tasks; i++) {
+    g_mutex_lock(&batch.mutex);
+    batch.pending++;
+    g_mutex_unlock(&batch.mutex);
+
+    if (!g_thread_pool_push(pool, &batch, &error)) {
+      g_warning("unable to push job to worker pool: %s", error->message);
+      g_error_free(error);
+      error = NULL;
+      g_mutex_lock(&batch.mutex);
+      batch.pending--;
+      g_mutex_unlock(&batch.mutex);
+      break;
+    }
+  }
+
+  run_jobs(&batch);
+
+  g_mutex_lock(&batch.mutex);
+  while (batch.pending > 0) {
+    g_cond_wait(&batch.cond, &batch.mutex);
+  }
+  g_mutex_unlock(&batch.mutex);
+
+  g_mutex_clear(&batch.mutex);
+  g_cond_clear(&batch.cond);
+}
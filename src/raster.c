@@ -0,0 +1,241 @@
+#include "raster.h"
+
+#include "box.h"
+#include "paint.h"
+#include "pool.h"
+
+/*
+ * The committed layer is split in a grid of tiles. Each tile keeps the list
+ * of committed paints that intersect it, so a dirty tile is rasterized
+ * without looking at the rest of the image. Dirty tiles are independent and
+ * are rasterized in parallel on the worker pool.
+ *
+ * Tiles are views into committed_surface: the pixels stay in one surface so
+ * the preview and export code can keep reading a single image. The tiling
+ * does not lower memory use, the whole layer stays allocated.
+ */
+
+struct raster_job {
+  struct swappy_state *state;
+  raster_paints_func func;
+  struct swappy_tile **tiles;
+  guchar *data;
+  gint stride;
+  cairo_format_t format;
+};
+
+static struct swappy_tile *tile_at(struct swappy_state *state, guint column,
+                                   guint row) {
+  return &state->tiles[row * state->tile_columns + column];
+}
+
+static void free_tiles(struct swappy_state *state) {
+  guint n_tiles = state->tile_columns * state->tile_rows;
+
+  for (guint i = 0; i < n_tiles; i++) {
+    g_list_free(state->tiles[i].paints);
+  }
+
+  g_free(state->tiles);
+  state->tiles = NULL;
+  state->tile_columns = 0;
+  state->tile_rows = 0;
+}
+
+void raster_init(struct swappy_state *state, gint width, gint height) {
+  free_tiles(state);
+
+  state->tile_columns = (width + RASTER_TILE_SIZE - 1) / RASTER_TILE_SIZE;
+  state->tile_rows = (height + RASTER_TILE_SIZE - 1) / RASTER_TILE_SIZE;
+  state->tiles =
+      g_new0(struct swappy_tile, state->tile_columns * state->tile_rows);
+
+  for (guint row = 0; row < state->tile_rows; row++) {
+    for (guint column = 0; column < state->tile_columns; column++) {
+      struct swappy_tile *tile = tile_at(state, column, row);
+      tile->box.x = column * RASTER_TILE_SIZE;
+      tile->box.y = row * RASTER_TILE_SIZE;
+      tile->box.width = MIN(RASTER_TILE_SIZE, width - tile->box.x);
+      tile->box.height = MIN(RASTER_TILE_SIZE, height - tile->box.y);
+      tile->is_dirty = true;
+    }
+  }
+
+  g_debug("tile grid created: %ux%u tiles for %dx%d", state->tile_columns,
+          state->tile_rows, width, height);
+}
+
+void raster_free(struct swappy_state *state) { free_tiles(state); }
+
+static bool tile_range(struct swappy_state *state, struct swappy_box *area,
+                       guint *c1, guint *r1, guint *c2, guint *r2) {
+  if (!state->tiles || is_empty_box(area)) {
+    return false;
+  }
+
+  gint x1 = MAX(area->x, 0) / RASTER_TILE_SIZE;
+  gint y1 = MAX(area->y, 0) / RASTER_TILE_SIZE;
+  gint x2 = (area->x + area->width - 1) / RASTER_TILE_SIZE;
+  gint y2 = (area->y + area->height - 1) / RASTER_TILE_SIZE;
+
+  if (x2 < 0 || y2 < 0 || x1 >= (gint)state->tile_columns ||
+      y1 >= (gint)state->tile_rows) {
+    return false;
+  }
+
+  *c1 = x1;
+  *r1 = y1;
+  *c2 = MIN((guint)x2, state->tile_columns - 1);
+  *r2 = MIN((guint)y2, state->tile_rows - 1);
+
+  return true;
+}
+
+void raster_invalidate(struct swappy_state *state, struct swappy_box *area) {
+  guint c1, r1, c2, r2;
+
+  if (!tile_range(state, area, &c1, &r1, &c2, &r2)) {
+    return;
+  }
+
+  for (guint row = r1; row <= r2; row++) {
+    for (guint column = c1; column <= c2; column++) {
+      tile_at(state, column, row)->is_dirty = true;
+    }
+  }
+}
+
+// A blur is pixelated from what is below it the first time it is drawn,
+// which can reach outside of the tile being rasterized.
+static bool needs_serial_pass(GList *paints) {
+  for (GList *elem = paints; elem; elem = elem->next) {
+    struct swappy_paint *paint = elem->data;
+    if (paint->type == SWAPPY_PAINT_MODE_BLUR &&
+        paint->content.blur.surface == NULL) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void rasterize_tile(guint index, gpointer data) {
+  struct raster_job *job = data;
+  struct swappy_tile *tile = job->tiles[index];
+  struct swappy_box *box = &tile->box;
+  gint bytes_per_pixel = 4;
+
+  guchar *tile_data =
+      job->data + box->y * job->stride + box->x * bytes_per_pixel;
+  cairo_surface_t *surface = cairo_image_surface_create_for_data(
+      tile_data, job->format, box->width, box->height, job->stride);
+  cairo_surface_set_device_offset(surface, -box->x, -box->y);
+
+  cairo_t *cr = cairo_create(surface);
+  job->func(cr, tile->paints, job->state);
+  cairo_destroy(cr);
+
+  cairo_surface_finish(surface);
+  cairo_surface_destroy(surface);
+}
+
+static void rasterize_serial(struct swappy_state *state,
+                             raster_paints_func func,
+                             struct swappy_tile **tiles, guint n_tiles,
+                             GList *paints) {
+  cairo_t *cr = cairo_create(state->committed_surface);
+
+  for (guint i = 0; i < n_tiles; i++) {
+    struct swappy_box *box = &tiles[i]->box;
+    cairo_rectangle(cr, box->x, box->y, box->width, box->height);
+  }
+  cairo_clip(cr);
+
+  func(cr, paints, state);
+
+  cairo_destroy(cr);
+}
+
+/*
+ * Rasterize every dirty tile of the committed layer. `area` is set to the
+ * part of the image that was rasterized. Returns false if nothing was dirty.
+ */
+bool raster_render_dirty(struct swappy_state *state, raster_paints_func func,
+                         struct swappy_box *area) {
+  guint n_tiles = state->tile_columns * state->tile_rows;
+  struct swappy_tile **dirty = g_new(struct swappy_tile *, n_tiles);
+  guint n_dirty = 0;
+  struct swappy_box dirty_area = {0};
+
+  for (guint i = 0; i < n_tiles; i++) {
+    struct swappy_tile *tile = &state->tiles[i];
+    if (tile->is_dirty) {
+      g_list_free(tile->paints);
+      tile->paints = NULL;
+      dirty[n_dirty++] = tile;
+      union_box(&dirty_area, &tile->box);
+    }
+  }
+
+  *area = dirty_area;
+
+  if (n_dirty == 0) {
+    g_free(dirty);
+    return false;
+  }
+
+  // Bucket the committed paints into the dirty tiles they touch
+  GList *paints = NULL;
+  for (GList *elem = state->paints; elem; elem = elem->next) {
+    struct swappy_paint *paint = elem->data;
+    struct swappy_box bounds;
+    bool is_used = false;
+
+    paint_get_bounds(state, paint, &bounds);
+    if (!intersect_box(&bounds, &dirty_area)) {
+      continue;
+    }
+
+    for (guint i = 0; i < n_dirty; i++) {
+      if (intersect_box(&bounds, &dirty[i]->box)) {
+        // state->paints is newest first, prepending keeps oldest first
+        dirty[i]->paints = g_list_prepend(dirty[i]->paints, paint);
+        is_used = true;
+      }
+    }
+
+    if (is_used) {
+      paints = g_list_prepend(paints, paint);
+    }
+  }
+
+  if (needs_serial_pass(paints)) {
+    g_debug("rasterizing %u tiles serially", n_dirty);
+    rasterize_serial(state, func, dirty, n_dirty, paints);
+  } else {
+    struct raster_job job = {
+        .state = state,
+        .func = func,
+        .tiles = dirty,
+        .format = cairo_image_surface_get_format(state->committed_surface),
+        .stride = cairo_image_surface_get_stride(state->committed_surface),
+    };
+
+    cairo_surface_flush(state->committed_surface);
+    job.data = cairo_image_surface_get_data(state->committed_surface);
+
+    pool_parallel_for(n_dirty, rasterize_tile, &job);
+
+    cairo_surface_mark_dirty(state->committed_surface);
+    g_debug("rasterized %u tiles on %u threads", n_dirty,
+            pool_get_n_threads());
+  }
+
+  for (guint i = 0; i < n_dirty; i++) {
+    dirty[i]->is_dirty = false;
+  }
+
+  g_list_free(paints);
+  g_free(dirty);
+
+  return true;
+}
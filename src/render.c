@@ -4,198 +4,127 @@
 #include <pango/pangocairo.h>
 
 #include "algebra.h"
+#include "box.h"
+#include "checkpoint.h"
+#include "enhance.h"
+#include "paint.h"
+#include "pixelate.h"
+#include "raster.h"
+#include "render.h"
 #include "swappy.h"
 #include "util.h"
+#include "zoom.h"
 
 #define pango_layout_t PangoLayout
 #define pango_font_description_t PangoFontDescription
 #define pango_rectangle_t PangoRectangle
 
-/*
- * Pixelate surface - non-reversible privacy redaction
- * Divides the region into blocks and fills each with the average color
- */
-static cairo_surface_t *blur_surface(cairo_surface_t *surface, double x,
-                                     double y, double width, double height) {
-  cairo_surface_t *dest_surface, *final = NULL;
-  cairo_t *cr;
-  int src_width, src_height;
-  int src_stride, dst_stride;
-  uint8_t *src_data, *dst_data;
-  uint32_t *s, *d, p;
-  int i, j, bi, bj;
-  const int block_size = 12;  // Size of pixelation blocks
-  gdouble scale_x, scale_y;
-
-  if (cairo_surface_status(surface)) {
-    return NULL;
-  }
-
-  cairo_surface_get_device_scale(surface, &scale_x, &scale_y);
-
-  cairo_format_t src_format = cairo_image_surface_get_format(surface);
-  switch (src_format) {
-    case CAIRO_FORMAT_A1:
-    case CAIRO_FORMAT_A8:
-    default:
-      g_warning("source surface format: %d is not supported", src_format);
-      return NULL;
-    case CAIRO_FORMAT_RGB24:
-    case CAIRO_FORMAT_ARGB32:
-      break;
-  }
-
-  src_stride = cairo_image_surface_get_stride(surface);
-  src_width = cairo_image_surface_get_width(surface);
-  src_height = cairo_image_surface_get_height(surface);
+static GMutex text_mutex;
 
-  dest_surface = cairo_image_surface_create(src_format, src_width, src_height);
-  cairo_surface_set_device_scale(dest_surface, scale_x, scale_y);
-
-  if (cairo_surface_status(dest_surface)) {
-    return NULL;
+static void convert_pango_rectangle_to_swappy_box(pango_rectangle_t rectangle,
+                                                  struct swappy_box *box) {
+  if (!box) {
+    return;
   }
 
-  // Copy original surface to dest
-  cr = cairo_create(dest_surface);
-  cairo_set_source_surface(cr, surface, 0, 0);
-  cairo_paint(cr);
-  cairo_destroy(cr);
+  box->x = pango_units_to_double(rectangle.x);
+  box->y = pango_units_to_double(rectangle.y);
+  box->width = pango_units_to_double(rectangle.width);
+  box->height = pango_units_to_double(rectangle.height);
+}
 
-  src_data = cairo_image_surface_get_data(surface);
-  dst_data = cairo_image_surface_get_data(dest_surface);
-  dst_stride = cairo_image_surface_get_stride(dest_surface);
-
-  int start_x = CLAMP((int)(x * scale_x), 0, src_width);
-  int start_y = CLAMP((int)(y * scale_y), 0, src_height);
-  int end_x = CLAMP((int)((x + width) * scale_x), 0, src_width);
-  int end_y = CLAMP((int)((y + height) * scale_y), 0, src_height);
-
-  int scaled_block = (int)(block_size * scale_x);
-  if (scaled_block < 4) scaled_block = 4;
-
-  // Process each block
-  for (i = start_y; i < end_y; i += scaled_block) {
-    for (j = start_x; j < end_x; j += scaled_block) {
-      guint64 sum_a = 0, sum_r = 0, sum_g = 0, sum_b = 0;
-      int count = 0;
-      int block_end_y = MIN(i + scaled_block, end_y);
-      int block_end_x = MIN(j + scaled_block, end_x);
-
-      // Calculate average color for this block
-      for (bi = i; bi < block_end_y; bi++) {
-        s = (uint32_t *)(src_data + bi * src_stride);
-        for (bj = j; bj < block_end_x; bj++) {
-          p = s[bj];
-          sum_a += (p >> 24) & 0xff;
-          sum_r += (p >> 16) & 0xff;
-          sum_g += (p >> 8) & 0xff;
-          sum_b += p & 0xff;
-          count++;
-        }
-      }
+/*
+ * Bring the cached layout of a text paint up to date, only what changed
+ * since the last render is set again.
+ */
+static pango_layout_t *text_get_layout(cairo_t *cr,
+                                       struct swappy_paint_text *text,
+                                       double width) {
+  if (!text->layout) {
+    text->layout = pango_cairo_create_layout(cr);
+    pango_layout_set_wrap(text->layout, PANGO_WRAP_WORD_CHAR);
+    text->layout_width = -1;
+  } else {
+    pango_cairo_update_layout(cr, text->layout);
+  }
 
-      if (count > 0) {
-        uint32_t avg_color = ((sum_a / count) << 24) |
-                             ((sum_r / count) << 16) |
-                             ((sum_g / count) << 8) |
-                             (sum_b / count);
-
-        // Fill block with average color
-        for (bi = i; bi < block_end_y; bi++) {
-          d = (uint32_t *)(dst_data + bi * dst_stride);
-          for (bj = j; bj < block_end_x; bj++) {
-            d[bj] = avg_color;
-          }
-        }
-      }
+  if (!text->font_desc || g_strcmp0(text->font, text->layout_font) != 0 ||
+      text->s != text->layout_size) {
+    char pango_font[255];
+    g_snprintf(pango_font, 255, "%s %d", text->font, (int)text->s);
+    if (text->font_desc) {
+      pango_font_description_free(text->font_desc);
     }
+    text->font_desc = pango_font_description_from_string(pango_font);
+    pango_layout_set_font_description(text->layout, text->font_desc);
+    g_free(text->layout_font);
+    text->layout_font = g_strdup(text->font);
+    text->layout_size = text->s;
   }
 
-  cairo_surface_mark_dirty(dest_surface);
-
-  final = cairo_image_surface_create(src_format, (int)(width * scale_x),
-                                     (int)(height * scale_y));
-
-  if (cairo_surface_status(final)) {
-    cairo_surface_destroy(dest_surface);
-    return NULL;
+  if (g_strcmp0(text->text, text->layout_text) != 0) {
+    pango_layout_set_text(text->layout, text->text, -1);
+    g_free(text->layout_text);
+    text->layout_text = g_strdup(text->text);
   }
 
-  cairo_surface_set_device_scale(final, scale_x, scale_y);
-  cr = cairo_create(final);
-  cairo_set_source_surface(cr, dest_surface, -x, -y);
-  cairo_paint(cr);
-  cairo_destroy(cr);
-
-  cairo_surface_destroy(dest_surface);
-  return final;
-}
-
-static void convert_pango_rectangle_to_swappy_box(pango_rectangle_t rectangle,
-                                                  struct swappy_box *box) {
-  if (!box) {
-    return;
+  if (width != text->layout_width) {
+    pango_layout_set_width(text->layout, pango_units_from_double(width));
+    text->layout_width = width;
   }
 
-  box->x = pango_units_to_double(rectangle.x);
-  box->y = pango_units_to_double(rectangle.y);
-  box->width = pango_units_to_double(rectangle.width);
-  box->height = pango_units_to_double(rectangle.height);
+  return text->layout;
 }
 
-static void render_text(cairo_t *cr, struct swappy_paint_text text,
+static void render_text(cairo_t *cr, struct swappy_paint_text *text,
                         struct swappy_state *state) {
-  char pango_font[255];
-  double x = fmin(text.from.x, text.to.x);
-  double y = fmin(text.from.y, text.to.y);
-  double w = fabs(text.from.x - text.to.x);
-  double h = fabs(text.from.y - text.to.y);
-
-  cairo_surface_t *surface =
-      cairo_image_surface_create(CAIRO_FORMAT_ARGB32, w, h);
-  cairo_t *crt = cairo_create(surface);
-
-  pango_layout_t *layout = pango_cairo_create_layout(crt);
-  pango_layout_set_text(layout, text.text, -1);
-  g_snprintf(pango_font, 255, "%s %d", text.font, (int)text.s);
-  pango_font_description_t *desc =
-      pango_font_description_from_string(pango_font);
-  pango_layout_set_width(layout, pango_units_from_double(w));
-  pango_layout_set_font_description(layout, desc);
-  pango_layout_set_wrap(layout, PANGO_WRAP_WORD_CHAR);
-  pango_font_description_free(desc);
-
-  if (text.mode == SWAPPY_TEXT_MODE_EDIT) {
-    pango_rectangle_t strong_pos;
-    struct swappy_box cursor_box;
+  double x = fmin(text->from.x, text->to.x);
+  double y = fmin(text->from.y, text->to.y);
+  double w = fabs(text->from.x - text->to.x);
+  double h = fabs(text->from.y - text->to.y);
+
+  // Tiles can be rasterized in parallel, the cached layout is shared
+  g_mutex_lock(&text_mutex);
+
+  cairo_save(cr);
+
+  if (text->mode == SWAPPY_TEXT_MODE_EDIT) {
     cairo_set_source_rgba(cr, 0.5, 0.5, 0.5, 0.3);
     cairo_set_line_width(cr, 5);
     cairo_rectangle(cr, x, y, w, h);
     cairo_stroke(cr);
-    glong bytes_til_cursor = string_get_nb_bytes_until(text.text, text.cursor);
+  }
+
+  // Text is clipped to its box
+  cairo_rectangle(cr, x, y, (int)w, (int)h);
+  cairo_clip(cr);
+  cairo_translate(cr, x, y);
+
+  pango_layout_t *layout = text_get_layout(cr, text, w);
+
+  if (text->mode == SWAPPY_TEXT_MODE_EDIT) {
+    pango_rectangle_t strong_pos;
+    struct swappy_box cursor_box;
+    glong bytes_til_cursor =
+        string_get_nb_bytes_until(text->text, text->cursor);
     pango_layout_get_cursor_pos(layout, bytes_til_cursor, &strong_pos, NULL);
     convert_pango_rectangle_to_swappy_box(strong_pos, &cursor_box);
-    cairo_move_to(crt, cursor_box.x, cursor_box.y);
-    cairo_set_source_rgba(crt, 0.3, 0.3, 0.3, 1);
-    cairo_line_to(crt, cursor_box.x, cursor_box.y + cursor_box.height);
-    cairo_stroke(crt);
+    cairo_move_to(cr, cursor_box.x, cursor_box.y);
+    cairo_set_source_rgba(cr, 0.3, 0.3, 0.3, 1);
+    cairo_line_to(cr, cursor_box.x, cursor_box.y + cursor_box.height);
+    cairo_stroke(cr);
     GdkRectangle area = {x + cursor_box.x, y + cursor_box.y + cursor_box.height,
                          0, 0};
     gtk_im_context_set_cursor_location(state->ui->im_context, &area);
   }
 
-  cairo_rectangle(crt, 0, 0, w, h);
-  cairo_set_source_rgba(crt, text.r, text.g, text.b, text.a);
-  cairo_move_to(crt, 0, 0);
-  pango_cairo_show_layout(crt, layout);
+  cairo_set_source_rgba(cr, text->r, text->g, text->b, text->a);
+  cairo_move_to(cr, 0, 0);
+  pango_cairo_show_layout(cr, layout);
 
-  cairo_set_source_surface(cr, surface, x, y);
-  cairo_paint(cr);
+  cairo_restore(cr);
 
-  cairo_destroy(crt);
-  cairo_surface_destroy(surface);
-  g_object_unref(layout);
+  g_mutex_unlock(&text_mutex);
 }
 
 static void render_shape_arrow(cairo_t *cr, struct swappy_paint_shape shape) {
@@ -259,25 +188,32 @@ static void render_shape_line(cairo_t *cr, struct swappy_paint_shape shape) {
   cairo_stroke(cr);
 }
 
-static void render_highlighter(cairo_t *cr, struct swappy_paint_brush brush) {
-  GList *points = brush.points;
-  if (!points) {
-    return;
-  }
-
+static void highlighter_set_style(cairo_t *cr,
+                                  struct swappy_paint_brush *brush) {
   // Highlighter: wide, semi-transparent, flat caps
-  cairo_set_source_rgba(cr, brush.r, brush.g, brush.b, 0.4);
-  cairo_set_line_width(cr, brush.w * 3);  // Wider than normal brush
+  cairo_set_line_width(cr, brush->w * 3);  // Wider than normal brush
   cairo_set_line_cap(cr, CAIRO_LINE_CAP_SQUARE);
   cairo_set_line_join(cr, CAIRO_LINE_JOIN_ROUND);
+}
 
-  struct swappy_point *point = points->data;
-  cairo_move_to(cr, point->x, point->y);
+static void brush_path(cairo_t *cr, struct swappy_paint_brush *brush,
+                       guint first) {
+  cairo_move_to(cr, brush->points[first].x, brush->points[first].y);
 
-  for (GList *elem = points->next; elem; elem = elem->next) {
-    point = elem->data;
-    cairo_line_to(cr, point->x, point->y);
+  for (guint i = first + 1; i < brush->n_points; i++) {
+    cairo_line_to(cr, brush->points[i].x, brush->points[i].y);
   }
+}
+
+static void render_highlighter(cairo_t *cr, struct swappy_paint_brush brush) {
+  if (brush.n_points == 0) {
+    return;
+  }
+
+  cairo_set_source_rgba(cr, brush.r, brush.g, brush.b,
+                        RENDER_HIGHLIGHTER_ALPHA);
+  highlighter_set_style(cr, &brush);
+  brush_path(cr, &brush, 0);
   cairo_stroke(cr);
 }
 
@@ -433,7 +369,8 @@ static void clear_surface(cairo_t *cr) {
   cairo_restore(cr);
 }
 
-static void render_blur(cairo_t *cr, struct swappy_paint *paint) {
+static void render_blur(cairo_t *cr, struct swappy_paint *paint,
+                        struct swappy_state *state) {
   struct swappy_paint_blur blur = paint->content.blur;
 
   cairo_surface_t *target = cairo_get_target(cr);
@@ -443,6 +380,10 @@ static void render_blur(cairo_t *cr, struct swappy_paint *paint) {
   double w = ABS(blur.from.x - blur.to.x);
   double h = ABS(blur.from.y - blur.to.y);
 
+  // Pixelated surfaces start on the source pixel grid
+  double origin_x = (gint)x;
+  double origin_y = (gint)y;
+
   cairo_save(cr);
 
   if (paint->is_committed) {
@@ -450,7 +391,7 @@ static void render_blur(cairo_t *cr, struct swappy_paint *paint) {
     if (blur.surface) {
       cairo_surface_t *surface = blur.surface;
       if (surface && cairo_surface_status(surface) == CAIRO_STATUS_SUCCESS) {
-        cairo_set_source_surface(cr, surface, x, y);
+        cairo_set_source_surface(cr, surface, origin_x, origin_y);
         cairo_paint(cr);
       }
     } else {
@@ -459,49 +400,53 @@ static void render_blur(cairo_t *cr, struct swappy_paint *paint) {
           "blurring surface on following image coordinates: %.2lf,%.2lf size: "
           "%.2lfx%.2lf",
           x, y, w, h);
-      cairo_surface_t *blurred = blur_surface(target, x, y, w, h);
+      cairo_surface_t *blurred = pixelate_region(
+          target, x, y, w, h, blur.from.x, blur.from.y);
 
       if (blurred && cairo_surface_status(blurred) == CAIRO_STATUS_SUCCESS) {
-        cairo_set_source_surface(cr, blurred, x, y);
+        cairo_set_source_surface(cr, blurred, origin_x, origin_y);
         cairo_paint(cr);
         paint->content.blur.surface = blurred;
       }
     }
   } else {
-    // Blur not committed yet, draw bounding rectangle
-    struct swappy_paint_shape rect = {
-        .r = 0,
-        .g = 0.5,
-        .b = 1,
-        .a = 0.5,
-        .w = 5,
-        .from = blur.from,
-        .to = blur.to,
-        .type = SWAPPY_PAINT_MODE_RECTANGLE,
-        .operation = SWAPPY_PAINT_SHAPE_OPERATION_FILL,
-    };
-    render_shape_rectangle(cr, rect);
+    // Blur not committed yet, preview it from the committed layer with the
+    // same block grid as the commit. Blocks are anchored at `from` so they
+    // stay put while the rectangle is resized.
+    cairo_surface_t *preview = pixelate_region_cached(
+        &state->blur_preview_cache, state->committed_surface,
+        state->committed_generation, x, y, w, h, blur.from.x, blur.from.y);
+
+    if (preview) {
+      cairo_set_source_surface(cr, preview, origin_x, origin_y);
+      cairo_paint(cr);
+      cairo_surface_destroy(preview);
+    }
+
+    cairo_set_source_rgba(cr, 0, 0.5, 1, 0.5);
+    cairo_set_line_width(cr, 1);
+    cairo_rectangle(cr, x, y, w, h);
+    cairo_stroke(cr);
   }
 
   cairo_restore(cr);
 }
 
-static void render_brush(cairo_t *cr, struct swappy_paint_brush brush) {
-  cairo_set_source_rgba(cr, brush.r, brush.g, brush.b, brush.a);
-  cairo_set_line_width(cr, brush.w);
+static void brush_set_style(cairo_t *cr, struct swappy_paint_brush *brush) {
+  cairo_set_line_width(cr, brush->w);
   cairo_set_line_join(cr, CAIRO_LINE_JOIN_BEVEL);
+}
 
-  guint l = g_list_length(brush.points);
+static void render_brush(cairo_t *cr, struct swappy_paint_brush brush) {
+  cairo_set_source_rgba(cr, brush.r, brush.g, brush.b, brush.a);
+  brush_set_style(cr, &brush);
 
-  if (l == 1) {
-    struct swappy_point *point = g_list_nth_data(brush.points, 0);
-    cairo_rectangle(cr, point->x, point->y, brush.w, brush.w);
+  if (brush.n_points == 1) {
+    cairo_rectangle(cr, brush.points[0].x, brush.points[0].y, brush.w,
+                    brush.w);
     cairo_fill(cr);
   } else {
-    for (GList *elem = brush.points; elem; elem = elem->next) {
-      struct swappy_point *point = elem->data;
-      cairo_line_to(cr, point->x, point->y);
-    }
+    brush_path(cr, &brush, 0);
     cairo_stroke(cr);
   }
 }
@@ -526,7 +471,7 @@ static void render_paint(cairo_t *cr, struct swappy_paint *paint,
   }
   switch (paint->type) {
     case SWAPPY_PAINT_MODE_BLUR:
-      render_blur(cr, paint);
+      render_blur(cr, paint, state);
       break;
     case SWAPPY_PAINT_MODE_BRUSH:
       render_brush(cr, paint->content.brush);
@@ -541,7 +486,7 @@ static void render_paint(cairo_t *cr, struct swappy_paint *paint,
       render_shape(cr, paint->content.shape);
       break;
     case SWAPPY_PAINT_MODE_TEXT:
-      render_text(cr, paint->content.text, state);
+      render_text(cr, &paint->content.text, state);
       break;
     case SWAPPY_PAINT_MODE_CROP: {
       int image_width = gdk_pixbuf_get_width(state->original_image);
@@ -555,33 +500,387 @@ static void render_paint(cairo_t *cr, struct swappy_paint *paint,
   }
 }
 
-static void render_paints(cairo_t *cr, struct swappy_state *state) {
-  for (GList *elem = g_list_last(state->paints); elem; elem = elem->prev) {
+static void render_image_bounds(struct swappy_state *state,
+                                struct swappy_box *box) {
+  box->x = 0;
+  box->y = 0;
+  box->width = cairo_image_surface_get_width(state->rendering_surface);
+  box->height = cairo_image_surface_get_height(state->rendering_surface);
+}
+
+static void clip_to_box(cairo_t *cr, struct swappy_box *box) {
+  cairo_rectangle(cr, box->x, box->y, box->width, box->height);
+  cairo_clip(cr);
+}
+
+/*
+ * Replay `paints` on the committed layer, `cr` is clipped to the tile being
+ * rasterized. Replay starts from the checkpoint when there is one, otherwise
+ * from the original image.
+ */
+static void render_committed(cairo_t *cr, GList *paints,
+                             struct swappy_state *state) {
+  struct swappy_checkpoint *base = state->checkpoint_base;
+
+  if (base) {
+    cairo_save(cr);
+    cairo_set_source_surface(cr, base->surface, 0, 0);
+    cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+    cairo_paint(cr);
+    cairo_restore(cr);
+  } else {
+    clear_surface(cr);
+    render_image(cr, state);
+  }
+
+  for (GList *elem = paints; elem; elem = elem->next) {
     struct swappy_paint *paint = elem->data;
+    if (base && paint->id <= base->paint_id) {
+      continue;
+    }
     render_paint(cr, paint, state);
   }
+}
 
-  if (state->temp_paint) {
-    render_paint(cr, state->temp_paint, state);
+static void render_committed_layer(cairo_t *cr, struct swappy_state *state) {
+  cairo_save(cr);
+  cairo_set_source_surface(cr, state->committed_surface, 0, 0);
+  cairo_set_operator(cr, CAIRO_OPERATOR_SOURCE);
+  cairo_paint(cr);
+  cairo_restore(cr);
+}
+
+static bool is_brush_paint(struct swappy_paint *paint) {
+  return paint && paint->can_draw &&
+         (paint->type == SWAPPY_PAINT_MODE_BRUSH ||
+          paint->type == SWAPPY_PAINT_MODE_HIGHLIGHTER);
+}
+
+/*
+ * Stroke the brush from point `first` into `cr` with full opacity, this is
+ * the coverage of that part of the stroke.
+ */
+static void stroke_coverage(cairo_t *cr, struct swappy_paint *paint,
+                            guint first) {
+  struct swappy_paint_brush *brush = &paint->content.brush;
+
+  cairo_set_source_rgba(cr, 0, 0, 0, 1);
+
+  if (paint->type == SWAPPY_PAINT_MODE_HIGHLIGHTER) {
+    highlighter_set_style(cr, brush);
+
+    // The start of the stroke gets the square cap the full stroke has
+    if (first == 0 && brush->n_points > 1) {
+      struct swappy_stroke_point *p0 = &brush->points[0];
+      struct swappy_stroke_point *p1 = &brush->points[1];
+      double length = hypot(p1->x - p0->x, p1->y - p0->y);
+      if (length > 0) {
+        double cap = brush->w * 3 / 2 / length;
+        cairo_save(cr);
+        cairo_set_line_cap(cr, CAIRO_LINE_CAP_BUTT);
+        cairo_move_to(cr, p0->x, p0->y);
+        cairo_line_to(cr, p0->x - (p1->x - p0->x) * cap,
+                      p0->y - (p1->y - p0->y) * cap);
+        cairo_stroke(cr);
+        cairo_restore(cr);
+      }
+    }
+
+    // Round caps stay inside the round joins of the full stroke
+    cairo_set_line_cap(cr, CAIRO_LINE_CAP_ROUND);
+    brush_path(cr, brush, first);
+    cairo_stroke(cr);
+  } else if (brush->n_points == 1) {
+    brush_set_style(cr, brush);
+    cairo_rectangle(cr, brush->points[0].x, brush->points[0].y, brush->w,
+                    brush->w);
+    cairo_fill(cr);
+  } else {
+    brush_set_style(cr, brush);
+    brush_path(cr, brush, first);
+    cairo_stroke(cr);
+  }
+}
+
+/*
+ * Merge the coverage of the stroke from point `first` into the stroke
+ * surface. Coverage is merged with max() so pixels where new segments
+ * overlap older ones do not build up. `area` is set to the updated region.
+ */
+static bool accumulate_stroke(struct swappy_state *state,
+                              struct swappy_paint *paint, guint first,
+                              struct swappy_box *area) {
+  struct swappy_paint_brush *brush = &paint->content.brush;
+  cairo_surface_t *target = state->stroke_surface;
+  struct swappy_box image = {
+      .width = cairo_image_surface_get_width(target),
+      .height = cairo_image_surface_get_height(target),
+  };
+  double x1 = G_MAXDOUBLE, y1 = G_MAXDOUBLE;
+  double x2 = -G_MAXDOUBLE, y2 = -G_MAXDOUBLE;
+
+  for (guint i = first; i < brush->n_points; i++) {
+    x1 = fmin(x1, brush->points[i].x);
+    y1 = fmin(y1, brush->points[i].y);
+    x2 = fmax(x2, brush->points[i].x);
+    y2 = fmax(y2, brush->points[i].y);
+  }
+
+  // Wide enough for the square cap and the single point square
+  double padding = paint->type == SWAPPY_PAINT_MODE_HIGHLIGHTER
+                       ? brush->w * 3 + 1
+                       : brush->w + 1;
+  box_from_extents(area, x1, y1, x2, y2, padding);
+
+  if (!clip_box(area, &image)) {
+    return false;
+  }
+
+  cairo_surface_t *scratch =
+      cairo_image_surface_create(CAIRO_FORMAT_A8, area->width, area->height);
+  if (cairo_surface_status(scratch)) {
+    cairo_surface_destroy(scratch);
+    return false;
+  }
+  cairo_surface_set_device_offset(scratch, -area->x, -area->y);
+
+  cairo_t *cr = cairo_create(scratch);
+  stroke_coverage(cr, paint, first);
+  cairo_destroy(cr);
+
+  cairo_surface_flush(scratch);
+  cairo_surface_flush(target);
+
+  guchar *src = cairo_image_surface_get_data(scratch);
+  gint src_stride = cairo_image_surface_get_stride(scratch);
+  guchar *dst = cairo_image_surface_get_data(target);
+  gint dst_stride = cairo_image_surface_get_stride(target);
+
+  for (gint y = 0; y < area->height; y++) {
+    guchar *s = src + y * src_stride;
+    guchar *d = dst + (area->y + y) * dst_stride + area->x;
+    for (gint x = 0; x < area->width; x++) {
+      d[x] = MAX(d[x], s[x]);
+    }
+  }
+
+  cairo_surface_mark_dirty_rectangle(target, area->x, area->y, area->width,
+                                     area->height);
+  cairo_surface_destroy(scratch);
+
+  return true;
+}
+
+static void clear_stroke(struct swappy_state *state) {
+  struct swappy_box *bounds = &state->stroke_bounds;
+
+  if (!is_empty_box(bounds)) {
+    cairo_t *cr = cairo_create(state->stroke_surface);
+    clip_to_box(cr, bounds);
+    clear_surface(cr);
+    cairo_destroy(cr);
+  }
+
+  *bounds = (struct swappy_box){0};
+  state->stroke_n_points = 0;
+}
+
+/*
+ * Brushes being drawn are accumulated in the stroke surface: only the
+ * points added since the last call are stroked, starting two points back so
+ * the join with the previous segment is right. Returns false when the
+ * temporary paint is not drawn incrementally.
+ */
+static bool render_stroke_update(struct swappy_state *state,
+                                 struct swappy_box *damage) {
+  struct swappy_paint *paint = state->temp_paint;
+  struct swappy_box area;
+
+  if (!is_brush_paint(paint)) {
+    state->stroke_paint = NULL;
+    return false;
+  }
+
+  struct swappy_paint_brush *brush = &paint->content.brush;
+
+  if (!state->stroke_surface) {
+    state->stroke_surface = cairo_image_surface_create(
+        CAIRO_FORMAT_A8,
+        cairo_image_surface_get_width(state->rendering_surface),
+        cairo_image_surface_get_height(state->rendering_surface));
+    if (cairo_surface_status(state->stroke_surface)) {
+      g_warning("unable to create stroke surface");
+      cairo_surface_destroy(state->stroke_surface);
+      state->stroke_surface = NULL;
+      return false;
+    }
+    state->stroke_bounds = (struct swappy_box){0};
+  }
+
+  // Start over on a new stroke, and once a single point dot turns into a line
+  if (state->stroke_paint != paint || state->stroke_width != brush->w ||
+      state->stroke_origin.x != brush->points[0].x ||
+      state->stroke_origin.y != brush->points[0].y ||
+      brush->n_points < state->stroke_n_points ||
+      (state->stroke_n_points == 1 && brush->n_points > 1)) {
+    union_box(damage, &state->stroke_bounds);
+    union_box(damage, &state->temp_paint_bounds);
+    clear_stroke(state);
+    state->stroke_paint = paint;
+    state->stroke_width = brush->w;
+    state->stroke_origin = brush->points[0];
+  }
+
+  if (brush->n_points == state->stroke_n_points) {
+    return true;
+  }
+
+  guint first = state->stroke_n_points >= 2 ? state->stroke_n_points - 2 : 0;
+
+  if (accumulate_stroke(state, paint, first, &area)) {
+    union_box(&state->stroke_bounds, &area);
+    union_box(damage, &area);
+  }
+  state->stroke_n_points = brush->n_points;
+
+  return true;
+}
+
+static void render_stroke(cairo_t *cr, struct swappy_state *state) {
+  struct swappy_paint *paint = state->stroke_paint;
+  struct swappy_paint_brush *brush = &paint->content.brush;
+  double alpha = paint->type == SWAPPY_PAINT_MODE_HIGHLIGHTER
+                     ? RENDER_HIGHLIGHTER_ALPHA
+                     : brush->a;
+
+  cairo_save(cr);
+  cairo_set_source_rgba(cr, brush->r, brush->g, brush->b, alpha);
+  cairo_mask_surface(cr, state->stroke_surface, 0, 0);
+  cairo_restore(cr);
+}
+
+/*
+ * Map a damaged area of the image to widget coordinates, following the
+ * transformation used by draw_area_handler, and only redraw that part.
+ */
+static void queue_draw_damage(struct swappy_state *state,
+                              struct swappy_box *damage) {
+  GtkWidget *area = state->ui->area;
+  gint image_width = cairo_image_surface_get_width(state->rendering_surface);
+  gint image_height = cairo_image_surface_get_height(state->rendering_surface);
+  gdouble scale_x = (gdouble)gtk_widget_get_allocated_width(area) /
+                    image_width * state->zoom_level;
+  gdouble scale_y = (gdouble)gtk_widget_get_allocated_height(area) /
+                    image_height * state->zoom_level;
+
+  gint x1 = (gint)floor(state->pan_x + damage->x * scale_x) - 1;
+  gint y1 = (gint)floor(state->pan_y + damage->y * scale_y) - 1;
+  gint x2 = (gint)ceil(state->pan_x + (damage->x + damage->width) * scale_x) + 1;
+  gint y2 =
+      (gint)ceil(state->pan_y + (damage->y + damage->height) * scale_y) + 1;
+
+  gtk_widget_queue_draw_area(area, x1, y1, x2 - x1, y2 - y1);
+}
+
+void render_invalidate_committed(struct swappy_state *state) {
+  struct swappy_box image;
+
+  render_image_bounds(state, &image);
+  raster_invalidate(state, &image);
+}
+
+void render_invalidate_paint(struct swappy_state *state,
+                             struct swappy_paint *paint) {
+  struct swappy_box bounds;
+
+  paint_get_bounds(state, paint, &bounds);
+  raster_invalidate(state, &bounds);
+}
+
+static gboolean render_tick(GtkWidget *widget, GdkFrameClock *frame_clock,
+                            gpointer data) {
+  struct swappy_state *state = data;
+
+  if (state->render_pending_events > 0) {
+    g_debug("rendering frame for %u coalesced input events",
+            state->render_pending_events);
+    render_state(state);
+  }
+
+  state->render_tick_id = 0;
+  return G_SOURCE_REMOVE;
+}
+
+/*
+ * Input handlers only update the state and call this, the render happens
+ * once per frame clock tick however many events arrived in between.
+ */
+void render_state_schedule(struct swappy_state *state) {
+  state->render_pending_events++;
+
+  if (state->render_tick_id == 0 && state->ui && state->ui->area) {
+    state->render_tick_id = gtk_widget_add_tick_callback(
+        state->ui->area, render_tick, state, NULL);
   }
 }
 
 void render_state(struct swappy_state *state) {
   cairo_surface_t *surface = state->rendering_surface;
+  struct swappy_box image, bounds, rasterized;
+  gboolean had_upscaled_preview = state->upscaled_preview_cache_valid;
+
+  render_image_bounds(state, &image);
+  state->render_pending_events = 0;
+
+  state->checkpoint_base = checkpoint_find(state);
+  gint64 replay_start = g_get_monotonic_time();
+
+  if (raster_render_dirty(state, render_committed, &rasterized)) {
+    gint64 replay_cost = g_get_monotonic_time() - replay_start;
+    state->committed_replay_count++;
+    state->committed_generation++;
+    g_debug("committed layer replayed on %dx%d at (%d,%d) from depth %u in "
+            "%" G_GINT64_FORMAT "us (%u replays)",
+            rasterized.width, rasterized.height, rasterized.x, rasterized.y,
+            state->checkpoint_base ? state->checkpoint_base->depth : 0,
+            replay_cost, state->committed_replay_count);
+    union_box(&state->damage, &rasterized);
+    checkpoint_update(state, replay_cost);
+  }
+
+  // The temp paint has to be erased where it was and drawn where it is now,
+  // a brush being drawn only changes where new points were added.
+  paint_get_bounds(state, state->temp_paint, &bounds);
+  if (!render_stroke_update(state, &state->damage)) {
+    union_box(&state->damage, &state->temp_paint_bounds);
+    union_box(&state->damage, &bounds);
+  }
+  state->temp_paint_bounds = bounds;
+
+  struct swappy_box damage = state->damage;
+  state->damage = (struct swappy_box){0};
+
+  if (!clip_box(&damage, &image)) {
+    return;
+  }
+
   cairo_t *cr = cairo_create(surface);
 
-  clear_surface(cr);
-  render_image(cr, state);
-  render_paints(cr, state);
+  clip_to_box(cr, &damage);
+  render_committed_layer(cr, state);
+
+  if (state->temp_paint && state->temp_paint == state->stroke_paint) {
+    render_stroke(cr, state);
+  } else if (state->temp_paint) {
+    render_paint(cr, state->temp_paint, state);
+  }
 
   cairo_destroy(cr);
+  state->content_generation++;
+  enhance_cache_damage(state->enhance_cache, &damage, state->content_generation);
+  zoom_cache_damage(state->zoom_cache, &damage, state->content_generation);
 
-  /* Invalidate enhanced preview cache since content changed */
-  if (state->enhanced_surface) {
-    cairo_surface_destroy(state->enhanced_surface);
-    state->enhanced_surface = NULL;
-  }
-  state->enhanced_preset_cache = -1;
+  /* Invalidate the upscaled preview since content changed */
   if (state->upscaled_preview_surface) {
     cairo_surface_destroy(state->upscaled_preview_surface);
     state->upscaled_preview_surface = NULL;
@@ -595,7 +894,12 @@ void render_state(struct swappy_state *state) {
   state->upscaled_preview_cache_valid = FALSE;
 
   // Drawing is finished, notify the GtkDrawingArea it needs to be redrawn.
+  // Dropping an external upscale preview changes the whole view.
   if (state->ui && state->ui->area && GTK_IS_WIDGET(state->ui->area)) {
-    gtk_widget_queue_draw(state->ui->area);
+    if (had_upscaled_preview) {
+      gtk_widget_queue_draw(state->ui->area);
+    } else {
+      queue_draw_damage(state, &damage);
+    }
   }
 }
@@ -0,0 +1,266 @@
+/*
+ * resample.c - area-averaging resampling to exact screen pixels
+ *
+ * Zoom levels between the factors of the upscalers are reached by scaling
+ * the upscaled image down. Every output pixel is the average of the area
+ * it covers, pixels partly covered counted by the covered fraction, so
+ * that all screen pixels get the same share of the image. Nearest
+ * neighbor sampling instead drops or doubles whole pixels, which shimmers
+ * while zooming.
+ *
+ * Weights are 8.8 fixed point and sum to 256 for each output pixel on
+ * each axis. Rows are blended vertically first, then horizontally, with
+ * SSE2 when available, or else two channels per 32-bit operation. Both
+ * paths round the same way and produce the same output.
+ */
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "resample.h"
+#include "scale2x.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define RESAMPLE_HAVE_SSE2 1
+#include <immintrin.h>
+#endif
+
+/* Source pixels and weights of the output pixels along one axis */
+struct resample_axis {
+    int n_taps;        /* Source pixels read per output pixel */
+    int *start;        /* First one of each output pixel */
+    uint16_t *weights; /* n_taps per output pixel */
+};
+
+static void axis_free(struct resample_axis *axis) {
+    free(axis->start);
+    free(axis->weights);
+}
+
+static int axis_init(struct resample_axis *axis, int src_size, double origin,
+                     double scale, int dst_size) {
+    double span = 1.0 / scale;
+
+    axis->n_taps = (int)ceil(span) + 1;
+    if (axis->n_taps > src_size) {
+        axis->n_taps = src_size;
+    }
+    axis->start = malloc((size_t)dst_size * sizeof(int));
+    axis->weights =
+        calloc((size_t)dst_size * axis->n_taps, sizeof(uint16_t));
+    if (!axis->start || !axis->weights) {
+        axis_free(axis);
+        return 0;
+    }
+
+    for (int i = 0; i < dst_size; i++) {
+        double a = origin + i * span;
+        double b = a + span;
+        uint16_t *weights = axis->weights + (size_t)i * axis->n_taps;
+
+        a = a < 0 ? 0 : (a > src_size ? src_size : a);
+        b = b < 0 ? 0 : (b > src_size ? src_size : b);
+
+        int start = (int)floor(a);
+        if (start > src_size - axis->n_taps) {
+            start = src_size - axis->n_taps;
+        }
+        axis->start[i] = start;
+
+        /* Past the edges, repeat the edge pixel */
+        if (b - a <= 0) {
+            weights[a > 0 ? axis->n_taps - 1 : 0] = 256;
+            continue;
+        }
+
+        /* Weights from the rounded running coverage always add up */
+        double covered = 0;
+        int previous = 0;
+        for (int k = 0; k < axis->n_taps; k++) {
+            double left = a > start + k ? a : start + k;
+            double right = b < start + k + 1 ? b : start + k + 1;
+
+            if (right > left) {
+                covered += right - left;
+            }
+
+            int total = (int)lround(covered / (b - a) * 256);
+            if (total > 256) {
+                total = 256;
+            }
+            weights[k] = (uint16_t)(total - previous);
+            previous = total;
+        }
+        weights[axis->n_taps - 1] += (uint16_t)(256 - previous);
+    }
+
+    return 1;
+}
+
+/* Weighted sum of n pixels `step` apart, two channels per operation */
+static inline uint32_t blend(const uint32_t *src, int step,
+                             const uint16_t *weights, int n) {
+    uint32_t rb = 0x00800080;
+    uint32_t ag = 0x00800080;
+
+    for (int k = 0; k < n; k++) {
+        uint32_t p = src[(size_t)k * step];
+
+        rb += (p & 0x00ff00ff) * weights[k];
+        ag += ((p >> 8) & 0x00ff00ff) * weights[k];
+    }
+
+    return ((rb >> 8) & 0x00ff00ff) | (ag & 0xff00ff00);
+}
+
+#ifdef RESAMPLE_HAVE_SSE2
+/* Same as blend on four columns at a time, returns the columns done */
+__attribute__((target("sse2"))) static int
+blend_rows_sse2(const uint32_t *src, int step, const uint16_t *weights,
+                int n, uint32_t *out, int width) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i round = _mm_set1_epi16(128);
+    int x = 0;
+
+    for (; x + 4 <= width; x += 4) {
+        __m128i lo = round;
+        __m128i hi = round;
+
+        for (int k = 0; k < n; k++) {
+            if (weights[k] == 0) {
+                continue;
+            }
+
+            __m128i w = _mm_set1_epi16((short)weights[k]);
+            __m128i p = _mm_loadu_si128(
+                (const __m128i *)(src + (size_t)k * step + x));
+
+            lo = _mm_add_epi16(lo, _mm_mullo_epi16(_mm_unpacklo_epi8(p, zero), w));
+            hi = _mm_add_epi16(hi, _mm_mullo_epi16(_mm_unpackhi_epi8(p, zero), w));
+        }
+
+        _mm_storeu_si128((__m128i *)(out + x),
+                         _mm_packus_epi16(_mm_srli_epi16(lo, 8),
+                                          _mm_srli_epi16(hi, 8)));
+    }
+
+    return x;
+}
+
+/*
+ * Same as blend on the output pixels of a row, two taps per operation,
+ * even taps in the low half and odd ones in the high half. Returns the
+ * pixels done.
+ */
+__attribute__((target("sse2"))) static int
+blend_columns_sse2(const uint32_t *row, int first,
+                   const struct resample_axis *columns, uint32_t *out,
+                   int dst_w) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i round = _mm_setr_epi16(128, 128, 128, 128, 0, 0, 0, 0);
+    int n = columns->n_taps;
+
+    for (int i = 0; i < dst_w; i++) {
+        const uint32_t *src = row + columns->start[i] - first;
+        const uint16_t *weights = columns->weights + (size_t)i * n;
+        __m128i sum = round;
+        int k = 0;
+
+        for (; k + 2 <= n; k += 2) {
+            uint32_t pair;
+
+            memcpy(&pair, weights + k, sizeof(pair));
+
+            __m128i w = _mm_cvtsi32_si128((int)pair);
+            w = _mm_unpacklo_epi16(w, w);
+            w = _mm_unpacklo_epi32(w, w);
+
+            __m128i p = _mm_loadl_epi64((const __m128i *)(src + k));
+            sum = _mm_add_epi16(
+                sum, _mm_mullo_epi16(_mm_unpacklo_epi8(p, zero), w));
+        }
+        if (k < n) {
+            __m128i p = _mm_cvtsi32_si128((int)src[k]);
+
+            sum = _mm_add_epi16(
+                sum, _mm_mullo_epi16(_mm_unpacklo_epi8(p, zero),
+                                     _mm_set1_epi16((short)weights[k])));
+        }
+
+        /* Both halves add up to at most 255 * 256 + 128 */
+        sum = _mm_add_epi16(sum, _mm_srli_si128(sum, 8));
+        out[i] = (uint32_t)_mm_cvtsi128_si32(
+            _mm_packus_epi16(_mm_srli_epi16(sum, 8), zero));
+    }
+
+    return dst_w;
+}
+#endif
+
+void resample_blend(const uint32_t *src, int step, const uint16_t *weights,
+                    int n, uint32_t *out, int width) {
+    int x = 0;
+
+#ifdef RESAMPLE_HAVE_SSE2
+    if (scale_simd_get() >= SCALE_SIMD_SSE2) {
+        x = blend_rows_sse2(src, step, weights, n, out, width);
+    }
+#endif
+
+    for (; x < width; x++) {
+        out[x] = blend(src + x, step, weights, n);
+    }
+}
+
+int resample_area(const uint32_t *src, int w, int h, int src_stride,
+                  double x, double y, double scale, uint32_t *dst,
+                  int dst_w, int dst_h, int dst_stride) {
+    struct resample_axis columns, rows;
+
+    if (w <= 0 || h <= 0 || dst_w <= 0 || dst_h <= 0 || scale <= 0) {
+        return 0;
+    }
+    if (!axis_init(&columns, w, x, scale, dst_w)) {
+        return 0;
+    }
+    if (!axis_init(&rows, h, y, scale, dst_h)) {
+        axis_free(&columns);
+        return 0;
+    }
+
+    /* Only the source columns read by the output are blended vertically */
+    int first = columns.start[0];
+    int width = columns.start[dst_w - 1] + columns.n_taps - first;
+    uint32_t *row = malloc((size_t)width * sizeof(uint32_t));
+    int ok = row != NULL;
+
+    if (ok) {
+        for (int j = 0; j < dst_h; j++) {
+            uint32_t *out = dst + (size_t)j * dst_stride;
+
+            resample_blend(src + (size_t)rows.start[j] * src_stride + first,
+                           src_stride, rows.weights + (size_t)j * rows.n_taps,
+                           rows.n_taps, row, width);
+
+            int i = 0;
+
+#ifdef RESAMPLE_HAVE_SSE2
+            if (scale_simd_get() >= SCALE_SIMD_SSE2) {
+                i = blend_columns_sse2(row, first, &columns, out, dst_w);
+            }
+#endif
+
+            for (; i < dst_w; i++) {
+                out[i] = blend(row + columns.start[i] - first, 1,
+                               columns.weights + (size_t)i * columns.n_taps,
+                               columns.n_taps);
+            }
+        }
+    }
+
+    free(row);
+    axis_free(&columns);
+    axis_free(&rows);
+    return ok;
+}
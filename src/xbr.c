@@ -0,0 +1,286 @@
+/*
+ * xbr.c - 2xBR edge-directed upscaling, after Hyllian's xBR
+ *
+ * EPX only follows 90 and 45 degree staircases. xBR weighs the color
+ * distances along both diagonals of a 5x5 neighborhood to find the edge
+ * direction, then blends the corner pixels towards it, so shallow lines
+ * and curves come out smooth.
+ *
+ * Distances are taken in YUV. Every input pixel is converted once per
+ * pass through per-channel lookup tables, the kernel only reads packed
+ * YUV values. Alpha is blended like the other channels, which is right
+ * for premultiplied ARGB32.
+ */
+
+#include <stdlib.h>
+
+#include "xbr.h"
+
+/* Neighborhood of the center pixel PE, indexed by row * 5 + column:
+ *
+ *       A1 B1 C1
+ *    A0 PA PB PC C4
+ *    D0 PD PE PF F4
+ *    G0 PG PH PI I4
+ *       G5 H5 I5
+ */
+enum {
+    A1 = 1, B1, C1,
+    A0 = 5, PA, PB, PC, C4,
+    D0 = 10, PD, PE, PF, F4,
+    G0 = 15, PG, PH, PI, I4,
+    G5 = 21, H5, I5,
+};
+
+/* The corner filter is written for the bottom right output pixel, the
+ * other corners are the same filter on the rotated neighborhood. Roles
+ * are PE PI PH PF PG PC PD PB F4 I4 H5 I5, then the output pixels the
+ * filter writes: the one above, the one on the left and the corner. */
+static const int corner_roles[4][15] = {
+    {PE, PI, PH, PF, PG, PC, PD, PB, F4, I4, H5, I5, 1, 2, 3},
+    {PE, PC, PF, PB, PI, PA, PH, PD, B1, C1, F4, C4, 0, 3, 1},
+    {PE, PA, PB, PD, PC, PG, PF, PH, D0, A0, B1, A1, 2, 1, 0},
+    {PE, PG, PD, PH, PA, PI, PB, PF, H5, G5, D0, G0, 3, 0, 2},
+};
+
+/* Colors closer than this are equal, as in ffmpeg's vf_xbr */
+#define XBR_EQ_DISTANCE 155
+
+/* Channel contributions to Y, U and V in 16.16 fixed point */
+static int32_t lut_y[3][256];
+static int32_t lut_u[3][256];
+static int32_t lut_v[3][256];
+
+void xbr_init(void) {
+    static const int32_t y_weights[3] = {19595, 38470, 7471};    /* .299 .587 .114 */
+    static const int32_t u_weights[3] = {-11076, -21692, 32768}; /* -.169 -.331 .5 */
+    static const int32_t v_weights[3] = {32768, -27460, -5308};  /* .5 -.419 -.081 */
+    static int initialized;
+
+    if (initialized) {
+        return;
+    }
+    initialized = 1;
+
+    for (int c = 0; c < 3; c++) {
+        for (int i = 0; i < 256; i++) {
+            lut_y[c][i] = y_weights[c] * i;
+            lut_u[c][i] = u_weights[c] * i;
+            lut_v[c][i] = v_weights[c] * i;
+        }
+    }
+}
+
+static inline uint32_t chroma(int32_t value) {
+    value = ((value + 32768) >> 16) + 128;
+    return value > 255 ? 255 : (uint32_t)value;
+}
+
+/* Packed alpha, Y, U and V of an ARGB32 pixel, 8 bits each */
+static inline uint32_t to_yuv(uint32_t p) {
+    int r = (p >> 16) & 0xff;
+    int g = (p >> 8) & 0xff;
+    int b = p & 0xff;
+
+    uint32_t y = (uint32_t)((lut_y[0][r] + lut_y[1][g] + lut_y[2][b] + 32768) >> 16);
+    uint32_t u = chroma(lut_u[0][r] + lut_u[1][g] + lut_u[2][b]);
+    uint32_t v = chroma(lut_v[0][r] + lut_v[1][g] + lut_v[2][b]);
+
+    return (p & 0xff000000u) | (y << 16) | (u << 8) | v;
+}
+
+/* Sum of the alpha, Y, U and V differences */
+static inline int df(uint32_t a, uint32_t b) {
+    return abs((int)(a >> 24) - (int)(b >> 24)) +
+           abs((int)((a >> 16) & 0xff) - (int)((b >> 16) & 0xff)) +
+           abs((int)((a >> 8) & 0xff) - (int)((b >> 8) & 0xff)) +
+           abs((int)(a & 0xff) - (int)(b & 0xff));
+}
+
+static inline int eq(uint32_t a, uint32_t b) {
+    return df(a, b) < XBR_EQ_DISTANCE;
+}
+
+/* dst + (src - dst) * m / 2^s, per channel */
+static inline uint32_t blend(uint32_t dst, uint32_t src, int m, int s) {
+    uint32_t out = 0;
+
+    for (int shift = 0; shift < 32; shift += 8) {
+        int d = (dst >> shift) & 0xff;
+        int c = (src >> shift) & 0xff;
+        out |= (uint32_t)(d + (((c - d) * m) >> s)) << shift;
+    }
+    return out;
+}
+
+static inline void corner(const uint32_t *n, const uint32_t *yuv,
+                          const int *role, uint32_t *e) {
+    uint32_t pe = n[role[0]], ph = n[role[2]];
+    uint32_t pf = n[role[3]], pg = n[role[4]], pc = n[role[5]];
+    uint32_t pd = n[role[6]], pb = n[role[7]];
+
+    if (pe == ph || pe == pf) {
+        return;
+    }
+
+    uint32_t ye = yuv[role[0]], yi = yuv[role[1]], yh = yuv[role[2]];
+    uint32_t yf = yuv[role[3]], yg = yuv[role[4]], yc = yuv[role[5]];
+    uint32_t yd = yuv[role[6]], yb = yuv[role[7]];
+    uint32_t yf4 = yuv[role[8]], yi4 = yuv[role[9]];
+    uint32_t yh5 = yuv[role[10]], yi5 = yuv[role[11]];
+    int up = role[12], left = role[13], out = role[14];
+
+    /* Edge strength across both diagonals */
+    int de = df(ye, yc) + df(ye, yg) + df(yi, yh5) + df(yi, yf4) +
+             (df(yh, yf) << 2);
+    int di = df(yh, yd) + df(yh, yi5) + df(yf, yi4) + df(yf, yb) +
+             (df(ye, yi) << 2);
+    uint32_t px = (df(ye, yf) <= df(ye, yh)) ? pf : ph;
+
+    if (de < di && ((!eq(yf, yb) && !eq(yh, yd)) ||
+                    (eq(ye, yi) && !eq(yf, yi4) && !eq(yh, yi5)) ||
+                    eq(ye, yg) || eq(ye, yc))) {
+        int ke = df(yf, yg);
+        int ki = df(yh, yc);
+        int ex2 = pe != pc && pb != pc;
+        int ex3 = pe != pg && pd != pg;
+
+        if ((ke << 1) <= ki && ex3 && ke >= (ki << 1) && ex2) {
+            e[out] = blend(e[out], px, 7, 3);
+            e[left] = blend(e[left], px, 1, 2);
+            e[up] = e[left];
+        } else if ((ke << 1) <= ki && ex3) {
+            e[out] = blend(e[out], px, 3, 2);
+            e[left] = blend(e[left], px, 1, 2);
+        } else if (ke >= (ki << 1) && ex2) {
+            e[out] = blend(e[out], px, 3, 2);
+            e[up] = blend(e[up], px, 1, 2);
+        } else {
+            e[out] = blend(e[out], px, 1, 1);
+        }
+    } else if (de <= di) {
+        e[out] = blend(e[out], px, 1, 1);
+    }
+}
+
+/* One 2x pass, yuv holds the converted input packed w pixels per row */
+static void xbr2x(const uint32_t *src, int w, int h, int src_stride,
+                  const uint32_t *yuv, uint32_t *dst, int dst_stride) {
+    for (int y = 0; y < h; y++) {
+        int rows[5];
+
+        for (int i = 0; i < 5; i++) {
+            int r = y + i - 2;
+            rows[i] = r < 0 ? 0 : (r >= h ? h - 1 : r);
+        }
+
+        uint32_t *d0 = dst + (size_t)y * 2 * dst_stride;
+        uint32_t *d1 = d0 + dst_stride;
+
+        const uint32_t *above = src + (size_t)rows[1] * src_stride;
+        const uint32_t *cur = src + (size_t)rows[2] * src_stride;
+        const uint32_t *below = src + (size_t)rows[3] * src_stride;
+
+        for (int x = 0; x < w; x++) {
+            uint32_t n[25], ny[25];
+            int columns[5];
+            uint32_t pe = cur[x];
+            uint32_t pb = above[x], ph = below[x];
+            uint32_t pd = cur[x > 0 ? x - 1 : 0];
+            uint32_t pf = cur[x < w - 1 ? x + 1 : x];
+
+            /* Every corner needs PE to differ from both of its sides */
+            if ((pe == ph || pe == pf) && (pe == pf || pe == pb) &&
+                (pe == pb || pe == pd) && (pe == pd || pe == ph)) {
+                d0[x * 2] = d0[x * 2 + 1] = pe;
+                d1[x * 2] = d1[x * 2 + 1] = pe;
+                continue;
+            }
+
+            for (int i = 0; i < 5; i++) {
+                int c = x + i - 2;
+                columns[i] = c < 0 ? 0 : (c >= w ? w - 1 : c);
+            }
+
+            for (int i = 0; i < 5; i++) {
+                const uint32_t *row = src + (size_t)rows[i] * src_stride;
+                const uint32_t *yrow = yuv + (size_t)rows[i] * w;
+
+                for (int j = 0; j < 5; j++) {
+                    n[i * 5 + j] = row[columns[j]];
+                    ny[i * 5 + j] = yrow[columns[j]];
+                }
+            }
+
+            uint32_t e[4] = {n[PE], n[PE], n[PE], n[PE]};
+
+            for (int c = 0; c < 4; c++) {
+                corner(n, ny, corner_roles[c], e);
+            }
+
+            d0[x * 2] = e[0];
+            d0[x * 2 + 1] = e[1];
+            d1[x * 2] = e[2];
+            d1[x * 2 + 1] = e[3];
+        }
+    }
+}
+
+int xbr_upscale(const uint32_t *src, int w, int h, int src_stride,
+                int factor, uint32_t *dst, int dst_stride) {
+    int passes = 0;
+
+    while ((1 << (passes + 1)) <= factor) {
+        passes++;
+    }
+    if (passes == 0 || (1 << passes) != factor) {
+        return 0;
+    }
+
+    uint32_t *yuv = malloc((size_t)(w << (passes - 1)) * (h << (passes - 1)) *
+                           sizeof(uint32_t));
+    uint32_t *images[2] = {NULL, NULL};
+    const uint32_t *in = src;
+    int in_stride = src_stride;
+    int ok = yuv != NULL;
+
+    for (int pass = 0; ok && pass < passes; pass++) {
+        int last = pass == passes - 1;
+        uint32_t *out = dst;
+        int out_stride = dst_stride;
+
+        for (int y = 0; y < h; y++) {
+            for (int x = 0; x < w; x++) {
+                yuv[(size_t)y * w + x] = to_yuv(in[(size_t)y * in_stride + x]);
+            }
+        }
+
+        if (!last) {
+            out = images[pass & 1] =
+                malloc((size_t)w * 2 * h * 2 * sizeof(uint32_t));
+            out_stride = w * 2;
+            if (!out) {
+                ok = 0;
+                break;
+            }
+        }
+
+        xbr2x(in, w, h, in_stride, yuv, out, out_stride);
+
+        /* The input of this pass is no longer needed */
+        if (pass > 0) {
+            free(images[(pass - 1) & 1]);
+            images[(pass - 1) & 1] = NULL;
+        }
+
+        in = out;
+        in_stride = out_stride;
+        w *= 2;
+        h *= 2;
+    }
+
+    free(images[0]);
+    free(images[1]);
+    free(yuv);
+    return ok;
+}
@@ -0,0 +1,710 @@
+#include "zoom.h"
+
+#include <math.h>
+#include <string.h>
+
+#include "box.h"
+#include "pool.h"
+#include "resample.h"
+#include "scale2x.h"
+
+/*
+ * The zoomed view is drawn from tiles of ZOOM_TILE_SIZE source pixels,
+ * upscaled on their own by the session's engine. A tile reads the halo of
+ * the engine around it, which covers what its passes look at, so tiles put
+ * side by side match the upscaled image. Panning only upscales the tiles
+ * it exposes.
+ *
+ * The kernels read the source surface in place and write the upscaled
+ * halo along with the tile into its surface, which is drawn with an
+ * offset. Surfaces of dropped tiles are kept for the next tiles of the
+ * same size.
+ *
+ * Zoom levels between factors scale the upscaled tiles down to whole
+ * device pixels. Each tile keeps its area-averaged copy for the last screen
+ * scale, so panning only resamples the tiles it exposes. A screen pixel
+ * belongs to the tile its left or top edge falls in, the halo covers the
+ * rest of its area.
+ *
+ * With an enhancement preset, tiles are enhanced before they are upscaled,
+ * so only the visible part of the image is enhanced, at source resolution.
+ * Sharpening reads around the tile in the source, so tiles stay seamless.
+ *
+ * When the view is idle, tiles around the last drawn area and the tiles of
+ * the next zoom factor are upscaled ahead of time.
+ *
+ * Edits only drop the tiles that read the damaged pixels. The tiles queued
+ * ahead of time are dropped too, they were picked for the view before the
+ * edit and the next frame queues them again.
+ */
+
+struct zoom_key {
+  gint column;
+  gint row;
+  gint factor;
+};
+
+struct zoom_tile {
+  struct zoom_key key;
+  cairo_surface_t *surface; /* Upscaled tile and halo */
+  gint x;                   /* Source area read, halo included */
+  gint y;
+  gint width;
+  gint height;
+  gint offset_x;            /* Tile in the surface, upscaled pixels */
+  gint offset_y;
+  gint tile_width;
+  gint tile_height;
+  gboolean is_valid;
+  cairo_surface_t *screen;  /* Tile resampled to device pixels */
+  gdouble screen_scale;     /* Device pixels per upscaled pixel */
+  gint screen_x;            /* Tile in the view, device pixels */
+  gint screen_y;
+  gboolean screen_is_valid;
+  GList link;               /* In the LRU queue */
+};
+
+struct zoom_job {
+  const struct scale_engine *engine;
+  cairo_surface_t *source;
+  gint threshold;
+  const struct enhance_lut *enhance;
+  struct zoom_tile **tiles;
+};
+
+// Device pixels per upscaled pixel this close to 1 draw the tiles as they are
+#define ZOOM_SCALE_EXACT 1e-6
+
+static guint key_hash(gconstpointer data) {
+  const struct zoom_key *key = data;
+
+  return ((guint)key->column * 73856093u) ^ ((guint)key->row * 19349663u) ^
+         ((guint)key->factor * 83492791u);
+}
+
+static gboolean key_equal(gconstpointer a, gconstpointer b) {
+  return memcmp(a, b, sizeof(struct zoom_key)) == 0;
+}
+
+static void surface_release(struct zoom_cache *cache,
+                            cairo_surface_t *surface) {
+  gsize size = (gsize)cairo_image_surface_get_stride(surface) *
+               cairo_image_surface_get_height(surface);
+
+  if (cairo_surface_status(surface) != CAIRO_STATUS_SUCCESS ||
+      cache->pool_size + size > ZOOM_POOL_BUDGET) {
+    cairo_surface_destroy(surface);
+    return;
+  }
+
+  g_queue_push_head(&cache->pool, surface);
+  cache->pool_size += size;
+}
+
+static cairo_surface_t *surface_acquire(struct zoom_cache *cache, gint width,
+                                        gint height) {
+  for (GList *link = cache->pool.head; link; link = link->next) {
+    cairo_surface_t *surface = link->data;
+
+    if (cairo_image_surface_get_width(surface) == width &&
+        cairo_image_surface_get_height(surface) == height) {
+      g_queue_delete_link(&cache->pool, link);
+      cache->pool_size -= (gsize)cairo_image_surface_get_stride(surface) *
+                          cairo_image_surface_get_height(surface);
+      return surface;
+    }
+  }
+
+  return cairo_image_surface_create(CAIRO_FORMAT_ARGB32, width, height);
+}
+
+static void tile_free(struct zoom_cache *cache, struct zoom_tile *tile) {
+  if (tile->surface) {
+    surface_release(cache, tile->surface);
+  }
+  if (tile->screen) {
+    surface_release(cache, tile->screen);
+  }
+  g_free(tile);
+}
+
+// Next factor of the engine zooming in, 0 past the largest one
+static gint next_factor(const struct scale_engine *engine, gint factor) {
+  for (const int *f = engine->factors; *f; f++) {
+    if (*f > factor) {
+      return *f;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Cheapest factor of the engine covering `scale`, the view is scaled down
+ * from it. Going down from a bigger factor would compute pixels that are
+ * thrown away.
+ */
+gint zoom_factor_for_scale(const struct scale_engine *engine, double scale) {
+  const int *f = engine->factors;
+
+  while (f[1] && *f < scale) {
+    f++;
+  }
+  return *f;
+}
+
+static void tile_init(struct zoom_tile *tile, struct zoom_cache *cache,
+                      struct zoom_key *key) {
+  gint src_width = cairo_image_surface_get_width(cache->source);
+  gint src_height = cairo_image_surface_get_height(cache->source);
+  gint halo = cache->engine->halo;
+  gint x = key->column * ZOOM_TILE_SIZE;
+  gint y = key->row * ZOOM_TILE_SIZE;
+
+  tile->key = *key;
+  tile->x = MAX(x - halo, 0);
+  tile->y = MAX(y - halo, 0);
+  tile->width = MIN(x + ZOOM_TILE_SIZE + halo, src_width) - tile->x;
+  tile->height = MIN(y + ZOOM_TILE_SIZE + halo, src_height) - tile->y;
+  tile->offset_x = (x - tile->x) * key->factor;
+  tile->offset_y = (y - tile->y) * key->factor;
+  tile->tile_width = MIN(ZOOM_TILE_SIZE, src_width - x) * key->factor;
+  tile->tile_height = MIN(ZOOM_TILE_SIZE, src_height - y) * key->factor;
+}
+
+static gsize tile_size(struct zoom_tile *tile) {
+  gsize size = (gsize)cairo_format_stride_for_width(
+                   CAIRO_FORMAT_ARGB32, tile->width * tile->key.factor) *
+               tile->height * tile->key.factor;
+
+  if (tile->screen) {
+    size += (gsize)cairo_image_surface_get_stride(tile->screen) *
+            cairo_image_surface_get_height(tile->screen);
+  }
+  return size;
+}
+
+static void tile_upscale(const struct scale_engine *engine,
+                         cairo_surface_t *source, struct zoom_tile *tile,
+                         gint threshold, const struct enhance_lut *enhance) {
+  gint src_stride = cairo_image_surface_get_stride(source);
+  guchar *src_data = cairo_image_surface_get_data(source);
+  guchar *data = cairo_image_surface_get_data(tile->surface);
+  gint stride = cairo_image_surface_get_stride(tile->surface);
+  guint32 *enhanced = NULL;
+
+  if (!data) {
+    return;
+  }
+
+  const guint32 *region =
+      (const guint32 *)(src_data + (gsize)tile->y * src_stride) + tile->x;
+  gint region_stride = src_stride / sizeof(guint32);
+
+  if (enhance) {
+    enhanced = g_try_new(guint32, (gsize)tile->width * tile->height);
+    if (!enhanced ||
+        !enhance_area(enhance, (const guint32 *)src_data,
+                      cairo_image_surface_get_width(source),
+                      cairo_image_surface_get_height(source), region_stride,
+                      tile->x, tile->y, tile->width, tile->height, enhanced,
+                      tile->width,
+                      cairo_image_surface_get_format(source) ==
+                          CAIRO_FORMAT_RGB24)) {
+      g_free(enhanced);
+      tile->is_valid = FALSE;
+      return;
+    }
+    region = enhanced;
+    region_stride = tile->width;
+  }
+
+  tile->is_valid = engine->upscale(region, tile->width, tile->height,
+                                   region_stride, tile->key.factor, threshold,
+                                   (guint32 *)data, stride / sizeof(guint32));
+  g_free(enhanced);
+  cairo_surface_mark_dirty(tile->surface);
+}
+
+/*
+ * Place the tile on the device pixel grid for `scale` and get the surface
+ * of its resampled copy. Surfaces come from the pool, so this runs on the
+ * drawing thread and tile_resample fills them in the workers.
+ */
+static void tile_screen_init(struct zoom_cache *cache, struct zoom_tile *tile,
+                             gdouble scale) {
+  gint x = tile->key.column * ZOOM_TILE_SIZE * tile->key.factor;
+  gint y = tile->key.row * ZOOM_TILE_SIZE * tile->key.factor;
+
+  if (tile->screen) {
+    surface_release(cache, tile->screen);
+    tile->screen = NULL;
+  }
+
+  tile->screen_scale = scale;
+  tile->screen_is_valid = FALSE;
+  tile->screen_x = (gint)ceil(x * scale);
+  tile->screen_y = (gint)ceil(y * scale);
+
+  gint width = (gint)ceil((x + tile->tile_width) * scale) - tile->screen_x;
+  gint height = (gint)ceil((y + tile->tile_height) * scale) - tile->screen_y;
+
+  if (width > 0 && height > 0) {
+    tile->screen = surface_acquire(cache, width, height);
+    cairo_surface_flush(tile->screen);
+  }
+}
+
+static void tile_resample(struct zoom_tile *tile) {
+  guchar *src_data = cairo_image_surface_get_data(tile->surface);
+  gint src_stride = cairo_image_surface_get_stride(tile->surface);
+  guchar *data = cairo_image_surface_get_data(tile->screen);
+  gint stride = cairo_image_surface_get_stride(tile->screen);
+  gint factor = tile->key.factor;
+  gdouble scale = tile->screen_scale;
+
+  if (!data) {
+    return;
+  }
+
+  // Screen pixel (x, y) covers [x, x + 1) / scale in upscaled pixels
+  tile->screen_is_valid = resample_area(
+      (const guint32 *)src_data, tile->width * factor, tile->height * factor,
+      src_stride / sizeof(guint32), tile->screen_x / scale - tile->x * factor,
+      tile->screen_y / scale - tile->y * factor, scale, (guint32 *)data,
+      cairo_image_surface_get_width(tile->screen),
+      cairo_image_surface_get_height(tile->screen), stride / sizeof(guint32));
+  cairo_surface_mark_dirty(tile->screen);
+}
+
+// New tiles are upscaled first, then the ones with a screen surface resampled
+static void upscale_job(guint index, gpointer data) {
+  struct zoom_job *job = data;
+  struct zoom_tile *tile = job->tiles[index];
+
+  if (!tile->is_valid) {
+    tile_upscale(job->engine, job->source, tile, job->threshold, job->enhance);
+  }
+  if (tile->is_valid && tile->screen && !tile->screen_is_valid) {
+    tile_resample(tile);
+  }
+}
+
+static struct zoom_tile *cache_lookup(struct zoom_cache *cache,
+                                      struct zoom_key *key) {
+  struct zoom_tile *tile = g_hash_table_lookup(cache->tiles, key);
+
+  if (tile) {
+    g_queue_unlink(&cache->lru, &tile->link);
+    g_queue_push_head_link(&cache->lru, &tile->link);
+  }
+
+  return tile;
+}
+
+static struct zoom_tile *tile_new(struct zoom_cache *cache,
+                                  struct zoom_key *key) {
+  struct zoom_tile *tile = g_new0(struct zoom_tile, 1);
+
+  tile_init(tile, cache, key);
+  tile->surface = surface_acquire(cache, tile->width * key->factor,
+                                  tile->height * key->factor);
+  cairo_surface_flush(tile->surface);
+
+  return tile;
+}
+
+static void cache_insert(struct zoom_cache *cache, struct zoom_tile *tile) {
+  if (!tile->is_valid) {
+    tile_free(cache, tile);
+    return;
+  }
+
+  tile->link.data = tile;
+  g_queue_push_head_link(&cache->lru, &tile->link);
+  g_hash_table_insert(cache->tiles, &tile->key, tile);
+  cache->size += tile_size(tile);
+}
+
+static void cache_remove(struct zoom_cache *cache, struct zoom_tile *tile) {
+  g_queue_unlink(&cache->lru, &tile->link);
+  cache->size -= tile_size(tile);
+  g_hash_table_remove(cache->tiles, &tile->key);
+  tile_free(cache, tile);
+}
+
+static void cache_trim(struct zoom_cache *cache) {
+  while (cache->size > ZOOM_CACHE_BUDGET && cache->lru.length > 0) {
+    cache_remove(cache, g_queue_peek_tail(&cache->lru));
+  }
+}
+
+static void prewarm_clear(struct zoom_cache *cache) {
+  gpointer key;
+
+  while ((key = g_queue_pop_head(&cache->prewarm))) {
+    g_free(key);
+  }
+}
+
+static void cache_clear(struct zoom_cache *cache) {
+  struct zoom_tile *tile;
+
+  g_hash_table_remove_all(cache->tiles);
+  while ((tile = g_queue_peek_head(&cache->lru))) {
+    g_queue_unlink(&cache->lru, &tile->link);
+    tile_free(cache, tile);
+  }
+  cache->size = 0;
+  prewarm_clear(cache);
+}
+
+static void cache_reset(struct zoom_cache *cache,
+                        const struct scale_engine *engine,
+                        cairo_surface_t *source, guint generation,
+                        gint threshold, const struct enhance_lut *enhance) {
+  cache_clear(cache);
+
+  if (cache->source) {
+    cairo_surface_destroy(cache->source);
+  }
+  cache->engine = engine;
+  cache->source = cairo_surface_reference(source);
+  cache->generation = generation;
+  cache->threshold = threshold;
+  cache->is_enhanced = enhance != NULL;
+  if (enhance) {
+    cache->enhance = *enhance;
+  }
+}
+
+static const struct enhance_lut *cache_enhance(struct zoom_cache *cache) {
+  return cache->is_enhanced ? &cache->enhance : NULL;
+}
+
+static gboolean tile_in_source(cairo_surface_t *source, gint column,
+                               gint row) {
+  gint columns = (cairo_image_surface_get_width(source) + ZOOM_TILE_SIZE - 1) /
+                 ZOOM_TILE_SIZE;
+  gint rows = (cairo_image_surface_get_height(source) + ZOOM_TILE_SIZE - 1) /
+              ZOOM_TILE_SIZE;
+
+  return column >= 0 && row >= 0 && column < columns && row < rows;
+}
+
+static void prewarm_push(struct zoom_cache *cache, gint column, gint row,
+                         gint factor) {
+  if (factor == 0 || !tile_in_source(cache->source, column, row)) {
+    return;
+  }
+
+  struct zoom_key *key = g_new(struct zoom_key, 1);
+  *key = (struct zoom_key){column, row, factor};
+  g_queue_push_tail(&cache->prewarm, key);
+}
+
+static gboolean prewarm_idle(gpointer data) {
+  struct zoom_cache *cache = data;
+  struct zoom_key *key;
+
+  // One tile per iteration, so that input is handled in between
+  while ((key = g_queue_pop_head(&cache->prewarm))) {
+    if (g_hash_table_contains(cache->tiles, key)) {
+      g_free(key);
+      continue;
+    }
+
+    // Tiles guessed ahead must not push out the ones in use
+    struct zoom_tile probe = {0};
+    tile_init(&probe, cache, key);
+    if (cache->size + tile_size(&probe) > ZOOM_CACHE_BUDGET) {
+      g_free(key);
+      prewarm_clear(cache);
+      break;
+    }
+
+    struct zoom_tile *tile = tile_new(cache, key);
+    g_free(key);
+
+    tile_upscale(cache->engine, cache->source, tile, cache->threshold,
+                 cache_enhance(cache));
+    cache_insert(cache, tile);
+    return G_SOURCE_CONTINUE;
+  }
+
+  g_debug("zoom cache pre-warmed, %u tiles (%" G_GSIZE_FORMAT " KiB)",
+          g_hash_table_size(cache->tiles), cache->size / 1024);
+  cache->prewarm_id = 0;
+  return G_SOURCE_REMOVE;
+}
+
+static void prewarm_schedule(struct zoom_cache *cache, gint column1,
+                             gint row1, gint column2, gint row2,
+                             gint factor) {
+  prewarm_clear(cache);
+
+  // Ring of tiles around the drawn ones, then the drawn ones zoomed in
+  for (gint column = column1 - 1; column <= column2 + 1; column++) {
+    prewarm_push(cache, column, row1 - 1, factor);
+    prewarm_push(cache, column, row2 + 1, factor);
+  }
+  for (gint row = row1; row <= row2; row++) {
+    prewarm_push(cache, column1 - 1, row, factor);
+    prewarm_push(cache, column2 + 1, row, factor);
+  }
+  for (gint row = row1; row <= row2; row++) {
+    for (gint column = column1; column <= column2; column++) {
+      prewarm_push(cache, column, row, next_factor(cache->engine, factor));
+    }
+  }
+
+  if (cache->prewarm.length > 0 && cache->prewarm_id == 0) {
+    cache->prewarm_id =
+        g_idle_add_full(G_PRIORITY_LOW, prewarm_idle, cache, NULL);
+  }
+}
+
+static struct zoom_cache *cache_new(void) {
+  struct zoom_cache *cache = g_new0(struct zoom_cache, 1);
+
+  cache->tiles = g_hash_table_new(key_hash, key_equal);
+  g_queue_init(&cache->lru);
+  g_queue_init(&cache->prewarm);
+  g_queue_init(&cache->pool);
+
+  return cache;
+}
+
+// Paint the tile in device pixels, the upscaled image is `scale` times them
+static void tile_paint(cairo_t *cr, struct zoom_tile *tile, gdouble scale) {
+  if (tile->screen && tile->screen_is_valid && tile->screen_scale == scale) {
+    cairo_set_source_surface(cr, tile->screen, tile->screen_x,
+                             tile->screen_y);
+    cairo_pattern_set_filter(cairo_get_source(cr), CAIRO_FILTER_NEAREST);
+    cairo_rectangle(cr, tile->screen_x, tile->screen_y,
+                    cairo_image_surface_get_width(tile->screen),
+                    cairo_image_surface_get_height(tile->screen));
+    cairo_fill(cr);
+    return;
+  }
+
+  double x = tile->key.column * ZOOM_TILE_SIZE * tile->key.factor;
+  double y = tile->key.row * ZOOM_TILE_SIZE * tile->key.factor;
+
+  cairo_save(cr);
+  cairo_scale(cr, scale, scale);
+  cairo_set_source_surface(cr, tile->surface, x - tile->offset_x,
+                           y - tile->offset_y);
+  cairo_pattern_set_filter(cairo_get_source(cr), CAIRO_FILTER_NEAREST);
+  cairo_rectangle(cr, x, y, tile->tile_width, tile->tile_height);
+  cairo_fill(cr);
+  cairo_restore(cr);
+}
+
+/*
+ * Draw `area` of `source`, in source pixels, upscaled by `engine` with one
+ * of its factors then scaled by `scale`. `cr` is only translated, to put
+ * the image origin in place, it is moved to the nearest device pixel. A
+ * threshold above 0 lets the Scale2x passes match anti-aliased colors.
+ * Tiles are enhanced with `enhance`, if not NULL, before they are upscaled.
+ */
+void zoom_draw(struct zoom_cache **cache, cairo_t *cr, cairo_surface_t *source,
+               guint generation, struct swappy_box *area,
+               const struct scale_engine *engine, gint factor, gdouble scale,
+               gint threshold, const struct enhance_lut *enhance) {
+  struct zoom_cache *current = *cache;
+
+  if (!current) {
+    current = cache_new();
+    *cache = current;
+  }
+
+  if (current->engine != engine || current->source != source ||
+      current->generation != generation || current->threshold != threshold ||
+      current->is_enhanced != (enhance != NULL) ||
+      (enhance && memcmp(&current->enhance, enhance,
+                         sizeof(struct enhance_lut)) != 0)) {
+    cache_reset(current, engine, source, generation, threshold, enhance);
+  }
+
+  cairo_surface_flush(source);
+
+  gint column1 = MAX(area->x, 0) / ZOOM_TILE_SIZE;
+  gint row1 = MAX(area->y, 0) / ZOOM_TILE_SIZE;
+  gint column2 = MIN(area->x + area->width,
+                     cairo_image_surface_get_width(source)) - 1;
+  gint row2 = MIN(area->y + area->height,
+                  cairo_image_surface_get_height(source)) - 1;
+
+  if (column2 < 0 || row2 < 0) {
+    return;
+  }
+
+  column2 /= ZOOM_TILE_SIZE;
+  row2 /= ZOOM_TILE_SIZE;
+
+  if (column1 > column2 || row1 > row2) {
+    return;
+  }
+
+  // Work in device pixels from a whole device pixel, on HiDPI screens too
+  gdouble device_x, device_y;
+  cairo_matrix_t matrix;
+  cairo_surface_get_device_scale(cairo_get_target(cr), &device_x, &device_y);
+  cairo_get_matrix(cr, &matrix);
+
+  cairo_save(cr);
+  cairo_identity_matrix(cr);
+  cairo_translate(cr, round(matrix.x0 * device_x) / device_x,
+                  round(matrix.y0 * device_y) / device_y);
+  cairo_scale(cr, 1 / device_x, 1 / device_y);
+  scale *= device_x;
+
+  gboolean exact = fabs(scale - 1) < ZOOM_SCALE_EXACT;
+  guint n_tiles = (column2 - column1 + 1) * (row2 - row1 + 1);
+  struct zoom_tile **tiles = g_new(struct zoom_tile *, n_tiles);
+  // Tiles to upscale first, then the cached ones to resample
+  struct zoom_tile **pending = g_new(struct zoom_tile *, n_tiles);
+  guint n_missing = 0;
+  guint n_pending = 0;
+  guint hits = 0;
+
+  for (gint row = row1, i = 0; row <= row2; row++) {
+    for (gint column = column1; column <= column2; column++, i++) {
+      struct zoom_key key = {column, row, factor};
+      struct zoom_tile *tile = cache_lookup(current, &key);
+
+      if (!tile) {
+        tile = tile_new(current, &key);
+        if (!exact) {
+          tile_screen_init(current, tile, scale);
+        }
+        pending[n_pending++] = tile;
+        n_missing++;
+      } else {
+        hits++;
+      }
+      tiles[i] = tile;
+    }
+  }
+
+  for (guint i = 0; i < n_tiles; i++) {
+    struct zoom_tile *tile = tiles[i];
+
+    if (exact && tile->screen) {
+      // Copies for an earlier scale would be painted at their old size
+      current->size -= tile_size(tile);
+      surface_release(current, tile->screen);
+      tile->screen = NULL;
+      tile->screen_scale = 0;
+      tile->screen_is_valid = FALSE;
+      current->size += tile_size(tile);
+    } else if (!exact && tile->is_valid && tile->screen_scale != scale) {
+      current->size -= tile_size(tile);
+      tile_screen_init(current, tile, scale);
+      current->size += tile_size(tile);
+      pending[n_pending++] = tile;
+    }
+  }
+
+  struct zoom_job job = {
+      .engine = engine,
+      .source = source,
+      .threshold = threshold,
+      .enhance = cache_enhance(current),
+      .tiles = pending,
+  };
+  pool_parallel_for(n_pending, upscale_job, &job);
+
+  // Tiles share their edges exactly, antialiasing would show the seams
+  cairo_set_antialias(cr, CAIRO_ANTIALIAS_NONE);
+
+  for (guint i = 0; i < n_tiles; i++) {
+    if (tiles[i]->is_valid) {
+      tile_paint(cr, tiles[i], scale);
+    }
+  }
+
+  cairo_restore(cr);
+
+  for (guint i = 0; i < n_missing; i++) {
+    cache_insert(current, pending[i]);
+  }
+  cache_trim(current);
+
+  current->hits += hits;
+  current->misses += n_missing;
+  g_debug("zoom cache at %s %dx: %u hits, %u misses, %u resampled at %.3f, "
+          "%u tiles (%" G_GSIZE_FORMAT " KiB), %u hits and %u misses so far",
+          engine->name, factor, hits, n_missing, exact ? 0 : n_pending, scale,
+          g_hash_table_size(current->tiles), current->size / 1024,
+          current->hits, current->misses);
+
+  g_free(tiles);
+  g_free(pending);
+
+  prewarm_schedule(current, column1, row1, column2, row2, factor);
+}
+
+void zoom_cache_damage(struct zoom_cache *cache, struct swappy_box *area,
+                       guint generation) {
+  if (!cache) {
+    return;
+  }
+
+  prewarm_clear(cache);
+
+  // Changes on top of content the tiles were not made from redo them all
+  if (cache->generation + 1 != generation) {
+    cache_clear(cache);
+    return;
+  }
+
+  cache->generation = generation;
+
+  // Source pixels read by the tiles, the sharpening mask reaches further
+  gint margin = cache->is_enhanced ? cache->enhance.sharpen_radius : 0;
+  struct swappy_box damage = {area->x - margin, area->y - margin,
+                              area->width + 2 * margin,
+                              area->height + 2 * margin};
+  guint n_dropped = 0;
+
+  for (GList *link = cache->lru.head; link;) {
+    struct zoom_tile *tile = link->data;
+    struct swappy_box read = {tile->x, tile->y, tile->width, tile->height};
+
+    link = link->next;
+    if (intersect_box(&read, &damage)) {
+      cache_remove(cache, tile);
+      n_dropped++;
+    }
+  }
+
+  if (n_dropped > 0) {
+    g_debug("zoom cache damaged, %u tiles dropped, %u kept", n_dropped,
+            g_hash_table_size(cache->tiles));
+  }
+}
+
+void zoom_cache_free(struct zoom_cache *cache) {
+  if (!cache) {
+    return;
+  }
+
+  if (cache->prewarm_id > 0) {
+    g_source_remove(cache->prewarm_id);
+  }
+
+  cache_clear(cache);
+  g_hash_table_destroy(cache->tiles);
+
+  cairo_surface_t *surface;
+  while ((surface = g_queue_pop_head(&cache->pool))) {
+    cairo_surface_destroy(surface);
+  }
+
+  if (cache->source) {
+    cairo_surface_destroy(cache->source);
+  }
+
+  g_free(cache);
+}
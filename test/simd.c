@@ -0,0 +1,383 @@
+#include <glib.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "enhance.h"
+#include "pixelate.h"
+#include "resample.h"
+#include "scale2x.h"
+
+/*
+ * The SIMD variants of the kernels must produce the same output as the
+ * scalar ones. Every kernel runs on edge-heavy patterns at each variant
+ * the CPU supports and is compared with its scalar output. Sizes are odd
+ * so that the scalar tails after the vector loops are covered too.
+ *
+ * usage: swappy-simd-test
+ */
+
+#define TEST_AA_THRESHOLD 16
+
+struct test_pattern {
+  const gchar *name;
+  gint width;
+  gint height;
+  guint32 *pixels; /* Premultiplied ARGB32, packed */
+};
+
+typedef guint32 *(*test_func)(const struct test_pattern *pattern,
+                              gsize *size);
+
+static const struct test_pattern *patterns;
+static guint n_patterns;
+static guint n_failures;
+
+// Premultiplied color from a few channel levels, so that neighbours often
+// match exactly or nearly
+static guint32 palette_color(GRand *rand, gboolean translucent) {
+  static const guint8 levels[] = {0, 8, 64, 128, 200, 250, 255};
+  guint32 a = translucent && g_rand_boolean(rand)
+                  ? levels[g_rand_int_range(rand, 0, G_N_ELEMENTS(levels))]
+                  : 255;
+  guint32 pixel = a << 24;
+
+  for (gint c = 0; c < 3; c++) {
+    guint32 value = levels[g_rand_int_range(rand, 0, G_N_ELEMENTS(levels))];
+
+    // Near colors for the anti-aliased matches
+    value = CLAMP((gint)value + g_rand_int_range(rand, -3, 4), 0, 255);
+    pixel |= (value * a / 255) << (8 * c);
+  }
+
+  return pixel;
+}
+
+static guint32 *pattern_new(GRand *rand, const gchar *name, gint width,
+                            gint height) {
+  guint32 *pixels = g_new(guint32, (gsize)width * height);
+  guint32 ink = palette_color(rand, FALSE);
+  guint32 paper = palette_color(rand, FALSE);
+
+  for (gint y = 0; y < height; y++) {
+    for (gint x = 0; x < width; x++) {
+      guint32 *p = &pixels[(gsize)y * width + x];
+
+      if (g_str_equal(name, "checker")) {
+        *p = ((x ^ y) & 1) ? ink : paper;
+      } else if (g_str_equal(name, "glyphs")) {
+        // Strokes and diagonals, as in text
+        *p = (x % 7 == 0 || y % 5 == 0 || (x + y) % 9 == 0) ? ink : paper;
+      } else if (g_str_equal(name, "translucent")) {
+        *p = palette_color(rand, TRUE);
+      } else {
+        *p = g_rand_int_range(rand, 0, 4) == 0 ? palette_color(rand, FALSE)
+                                                : paper;
+      }
+    }
+  }
+
+  return pixels;
+}
+
+static guint32 *run_scale2x(const struct test_pattern *p, gsize *size) {
+  guint32 *dst = g_new(guint32, (gsize)p->width * p->height * 4);
+
+  scale2x(p->pixels, dst, p->width, p->height);
+  *size = (gsize)p->width * p->height * 4;
+  return dst;
+}
+
+static guint32 *run_scale3x(const struct test_pattern *p, gsize *size) {
+  guint32 *dst = g_new(guint32, (gsize)p->width * p->height * 9);
+
+  scale3x(p->pixels, dst, p->width, p->height);
+  *size = (gsize)p->width * p->height * 9;
+  return dst;
+}
+
+static guint32 *run_scale2x_aa(const struct test_pattern *p, gsize *size) {
+  guint32 *dst = g_new(guint32, (gsize)p->width * p->height * 4);
+
+  scale2x_aa(p->pixels, dst, p->width, p->height, TEST_AA_THRESHOLD);
+  *size = (gsize)p->width * p->height * 4;
+  return dst;
+}
+
+// Every chain of passes, exact and anti-aliased, into one buffer
+static guint32 *run_scale_nx_into(const struct test_pattern *p, gsize *size) {
+  static const gint scales[] = {2, 3, 4, 6, 8, 9};
+  gsize total = 0;
+
+  for (gsize i = 0; i < G_N_ELEMENTS(scales); i++) {
+    total += (gsize)p->width * p->height * scales[i] * scales[i] * 2;
+  }
+
+  guint32 *dst = g_new0(guint32, total);
+  guint32 *out = dst;
+
+  for (gsize i = 0; i < G_N_ELEMENTS(scales); i++) {
+    for (gint threshold = 0; threshold <= TEST_AA_THRESHOLD;
+         threshold += TEST_AA_THRESHOLD) {
+      gint stride = p->width * scales[i];
+
+      if (!scale_nx_into(p->pixels, p->width, p->height, p->width, scales[i],
+                         threshold, out, stride)) {
+        g_printerr("scale_nx_into failed at %dx\n", scales[i]);
+      }
+      out += (gsize)stride * p->height * scales[i];
+    }
+  }
+
+  *size = total;
+  return dst;
+}
+
+static guint32 *run_resample_area(const struct test_pattern *p, gsize *size) {
+  static const gdouble scales[] = {0.3, 0.437, 0.8, 1.7};
+  gsize total = 0;
+
+  for (gsize i = 0; i < G_N_ELEMENTS(scales); i++) {
+    total += (gsize)((gint)(p->width * scales[i]) + 1) *
+             ((gint)(p->height * scales[i]) + 1);
+  }
+
+  guint32 *dst = g_new0(guint32, total);
+  guint32 *out = dst;
+
+  // One more column and row than the image covers, for the clamped edges
+  for (gsize i = 0; i < G_N_ELEMENTS(scales); i++) {
+    gint width = (gint)(p->width * scales[i]) + 1;
+    gint height = (gint)(p->height * scales[i]) + 1;
+
+    resample_area(p->pixels, p->width, p->height, p->width, 0.25, 0.5,
+                  scales[i], out, width, height, width);
+    out += (gsize)width * height;
+  }
+
+  *size = total;
+  return dst;
+}
+
+// Blends along rows then down columns, as the unsharp mask does
+static guint32 *run_resample_blend(const struct test_pattern *p,
+                                   gsize *size) {
+  static const guint16 weights[][7] = {
+      {27, 202, 27},
+      {1, 254, 1},
+      {4, 20, 58, 92, 58, 20, 4},
+  };
+  static const gint n_taps[] = {3, 3, 7};
+  gsize total = 0;
+
+  for (gsize i = 0; i < G_N_ELEMENTS(n_taps); i++) {
+    total += (gsize)p->width * p->height * 2;
+  }
+
+  guint32 *dst = g_new0(guint32, total);
+  guint32 *out = dst;
+
+  for (gsize i = 0; i < G_N_ELEMENTS(n_taps); i++) {
+    gint n = n_taps[i];
+
+    for (gint y = 0; y < p->height; y++) {
+      if (p->width >= n) {
+        resample_blend(p->pixels + (gsize)y * p->width, 1, weights[i], n,
+                       out + (gsize)y * p->width, p->width - n + 1);
+      }
+    }
+    out += (gsize)p->width * p->height;
+
+    for (gint y = 0; y + n <= p->height; y++) {
+      resample_blend(p->pixels + (gsize)y * p->width, p->width, weights[i], n,
+                     out + (gsize)y * p->width, p->width);
+    }
+    out += (gsize)p->width * p->height;
+  }
+
+  *size = total;
+  return dst;
+}
+
+// Saturation and the unsharp mask, over the whole pattern and a corner
+static guint32 *run_enhance_area(const struct test_pattern *p, gsize *size) {
+  static const EnhancePreset presets[] = {ENHANCE_VIVID, ENHANCE_SUBTLE,
+                                          ENHANCE_TEXT};
+  static const guint radii[] = {1, 3};
+  gsize area = (gsize)p->width * p->height;
+  guint32 *dst = g_new0(guint32, area * 2 * G_N_ELEMENTS(presets) * 2);
+  guint32 *out = dst;
+
+  for (gsize r = 0; r < G_N_ELEMENTS(radii); r++) {
+    enhance_set_sharpen(radii[r], 150);
+
+    for (gsize i = 0; i < G_N_ELEMENTS(presets); i++) {
+      struct enhance_lut lut;
+      gint width = (p->width + 1) / 2;
+      gint height = (p->height + 1) / 2;
+
+      enhance_lut_init(&lut, presets[i], NULL);
+      enhance_area(&lut, p->pixels, p->width, p->height, p->width, 0, 0,
+                   p->width, p->height, out, p->width, FALSE);
+      out += area;
+      enhance_area(&lut, p->pixels, p->width, p->height, p->width,
+                   p->width - width, p->height - height, width, height, out,
+                   width, FALSE);
+      out += area;
+    }
+  }
+
+  *size = area * 2 * G_N_ELEMENTS(presets) * 2;
+  return dst;
+}
+
+// Copy the pixels of `surface` after `out`, returns the pixels copied
+static gsize append_surface(cairo_surface_t *surface, guint32 *out) {
+  gint width = cairo_image_surface_get_width(surface);
+  gint height = cairo_image_surface_get_height(surface);
+  gint stride = cairo_image_surface_get_stride(surface);
+  guchar *data = cairo_image_surface_get_data(surface);
+
+  cairo_surface_flush(surface);
+  for (gint y = 0; y < height; y++) {
+    memcpy(out + (gsize)y * width, data + (gsize)y * stride,
+           sizeof(guint32) * width);
+  }
+
+  return (gsize)width * height;
+}
+
+// Regions inside, across and around the pattern, then a rectangle dragged
+// larger and smaller through the block cache
+static guint32 *run_pixelate(const struct test_pattern *p, gsize *size) {
+  const gdouble regions[][6] = {
+      {0, 0, p->width, p->height, 0, 0},
+      {1, 2, p->width - 1, p->height - 2, 5, 7},
+      {-7, -3, p->width + 20, p->height + 9, -7, -3},
+      {p->width / 2, p->height / 3, 30, 17, p->width, p->height},
+  };
+  const gdouble drag[][2] = {{40, 25}, {55, 30}, {20, 10}, {90, 60}, {3, 2}};
+  cairo_surface_t *source = cairo_image_surface_create_for_data(
+      (guchar *)p->pixels, CAIRO_FORMAT_ARGB32, p->width, p->height,
+      p->width * 4);
+  struct pixelate_cache *cache = NULL;
+  gsize total = 0;
+
+  for (gsize i = 0; i < G_N_ELEMENTS(regions); i++) {
+    total += (gsize)MAX(regions[i][2], 0) * MAX(regions[i][3], 0);
+  }
+  for (gsize i = 0; i < G_N_ELEMENTS(drag); i++) {
+    total += (gsize)drag[i][0] * drag[i][1];
+  }
+
+  guint32 *dst = g_new0(guint32, total);
+  guint32 *out = dst;
+
+  for (gsize i = 0; i < G_N_ELEMENTS(regions); i++) {
+    const gdouble *r = regions[i];
+    cairo_surface_t *result =
+        pixelate_region(source, r[0], r[1], r[2], r[3], r[4], r[5]);
+
+    if (result) {
+      out += append_surface(result, out);
+      cairo_surface_destroy(result);
+    }
+  }
+
+  for (gsize i = 0; i < G_N_ELEMENTS(drag); i++) {
+    cairo_surface_t *result = pixelate_region_cached(
+        &cache, source, 0, 3, 1, drag[i][0], drag[i][1], 3, 1);
+
+    if (result) {
+      out += append_surface(result, out);
+      cairo_surface_destroy(result);
+    }
+  }
+
+  pixelate_cache_free(cache);
+  cairo_surface_destroy(source);
+
+  *size = total;
+  return dst;
+}
+
+static void check(const gchar *kernel, test_func func) {
+  for (guint i = 0; i < n_patterns; i++) {
+    const struct test_pattern *p = &patterns[i];
+    gsize size, simd_size;
+
+    scale_simd_set(SCALE_SIMD_SCALAR);
+    guint32 *expected = func(p, &size);
+
+    for (scale_simd_level level = SCALE_SIMD_SSE2; level <= SCALE_SIMD_AVX2;
+         level++) {
+      scale_simd_set(level);
+      if (scale_simd_get() != level) {
+        g_print("%-18s %-12s %3dx%-3d %s: not supported\n", kernel, p->name,
+                p->width, p->height, scale_simd_name(level));
+        continue;
+      }
+
+      guint32 *actual = func(p, &simd_size);
+      gsize first = 0;
+
+      while (first < size && expected[first] == actual[first]) {
+        first++;
+      }
+
+      if (first < size) {
+        g_printerr("%-18s %-12s %3dx%-3d %s: pixel %" G_GSIZE_FORMAT
+                   " is %08x, scalar %08x\n",
+                   kernel, p->name, p->width, p->height,
+                   scale_simd_name(level), first, actual[first],
+                   expected[first]);
+        n_failures++;
+      } else {
+        g_print("%-18s %-12s %3dx%-3d %s: ok\n", kernel, p->name, p->width,
+                p->height, scale_simd_name(level));
+      }
+      g_free(actual);
+    }
+    g_free(expected);
+  }
+}
+
+int main(void) {
+  static const gchar *names[] = {"checker", "glyphs", "noise", "translucent"};
+  static const gint sizes[][2] = {{1, 1}, {5, 3}, {37, 23}, {130, 41}};
+  GRand *rand = g_rand_new_with_seed(2026);
+  struct test_pattern all[G_N_ELEMENTS(names) * G_N_ELEMENTS(sizes)];
+
+  for (gsize i = 0; i < G_N_ELEMENTS(names); i++) {
+    for (gsize j = 0; j < G_N_ELEMENTS(sizes); j++) {
+      struct test_pattern *p = &all[i * G_N_ELEMENTS(sizes) + j];
+
+      p->name = names[i];
+      p->width = sizes[j][0];
+      p->height = sizes[j][1];
+      p->pixels = pattern_new(rand, names[i], p->width, p->height);
+    }
+  }
+  patterns = all;
+  n_patterns = G_N_ELEMENTS(all);
+
+  check("scale2x", run_scale2x);
+  check("scale3x", run_scale3x);
+  check("scale2x_aa", run_scale2x_aa);
+  check("scale_nx_into", run_scale_nx_into);
+  check("resample_area", run_resample_area);
+  check("resample_blend", run_resample_blend);
+  check("enhance_area", run_enhance_area);
+  check("pixelate", run_pixelate);
+
+  for (guint i = 0; i < n_patterns; i++) {
+    g_free(all[i].pixels);
+  }
+  g_rand_free(rand);
+
+  if (n_failures > 0) {
+    g_printerr("%u kernels differ from their scalar output\n", n_failures);
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}